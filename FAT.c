@@ -1,5 +1,21 @@
+#define _GNU_SOURCE
 #include "FAT.h"
 
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
 #ifdef __unix__
 
   #define CYAN "\033[36m"
@@ -16,36 +32,67 @@
 
 static struct global_data_t global_data;
 
-int loadDiskImage(const char *name) {
-  global_data.diskFilename = name;
-  FILE *diskFile = fopen(name, "rb");
-  if (diskFile == NULL) {
+void setLoadOptions(struct load_options_t options) {
+  global_data.options = options;
+}
+
+Volume_t *volumeOpen(const char *name, struct load_options_t options) {
+  Volume_t *volume = calloc(1, sizeof(Volume_t));
+  if (volume == NULL) {
+    printf("Couldn't allocate memory\n");
+    return NULL;
+  }
+  pthread_mutex_init(&volume->lock, NULL);
+  volume->filename = name;
+  volume->image = imageOpen(name);
+  if (volume->image == NULL) {
     printf("Couldn't open %s\n", name);
-    return 1;
+    volumeClose(volume);
+    return NULL;
   }
+  Image_t *image = volume->image;
 
-  global_data.BS = calloc(1, sizeof(BootSector_t));
+  // with an overlay every read below sees the image as it was left by the last flush
+  if (options.overlay != NULL && imageOverlayOpen(image, options.overlay) != 0) {
+    printf("Couldn't open %s as an overlay of %s\n", options.overlay, name);
+    volumeClose(volume);
+    return NULL;
+  }
 
-  if (global_data.BS == NULL) {
+  volume->BS = calloc(1, sizeof(BootSector_t));
+
+  if (volume->BS == NULL) {
     printf("Couldn't allocate memory\n");
-    fclose(diskFile);
-    return 1;
+    volumeClose(volume);
+    return NULL;
+  }
+
+  if (imageRead(image, volume->BS, sizeof(BootSector_t), 0) != sizeof(BootSector_t)) {
+    printf("Couldn't read the boot sector\n");
+    volumeClose(volume);
+    return NULL;
   }
 
-  fread(global_data.BS, sizeof(BootSector_t), 1, diskFile);
+  BootSector_t *BS = volume->BS;
 
-  BootSector_t *BS = global_data.BS;
+  // sectors are 512 to 4096 bytes, anything else means the boot sector isn't one
+  bool sector_size = BS->bytes_per_sector >= 512 && BS->bytes_per_sector <= 4096 && (BS->bytes_per_sector & (BS->bytes_per_sector - 1)) == 0;
+  if (!sector_size || BS->sectors_per_cluster == 0 || BS->FATs == 0) {
+    printf("%s doesn't look like a FAT image\n", name);
+    volumeClose(volume);
+    return NULL;
+  }
 
   uint32_t number_of_sectors = MAX(BS->number_of_sectors_2b, BS->number_of_sectors_4b);
 
   uint32_t FAT_in_bytes = BS->size_of_FAT * BS->bytes_per_sector;
-  uint32_t cluster_in_bytes = BS->sectors_per_cluster * BS->bytes_per_sector;
+  uint64_t FAT_offset = (uint64_t)BS->reserved_area * BS->bytes_per_sector;
   uint8_t **FATs = calloc(BS->FATs, sizeof(uint8_t *));
 
   if (FATs == NULL) {
     printf("Couldn't allocate memory\n");
-    free(BS);
-    return 1;
+    volumeClose(volume);
+    return NULL;
   }
   
   for (int i = 0; i < BS->FATs; i++) {
@@ -55,73 +102,113 @@ int loadDiskImage(const char *name) {
         free(FATs[j]);
       }
       free(FATs);
-      free(BS);
-      fclose(diskFile);
+      volumeClose(volume);
       printf("Couldn't allocate memory\n");
-      return 1;
+      return NULL;
     }
-    fread(FATs[i], FAT_in_bytes, 1, diskFile);
+    imageRead(image, FATs[i], FAT_in_bytes, FAT_offset + (uint64_t)i * FAT_in_bytes);
   }
 
-  uint8_t *FAT = FATs[0];
+  bool consistent = checkFATCopies(FATs, BS->FATs, FAT_in_bytes, options.fatPolicy);
+
+  volume->FAT = FATs[0];
 
   for (int i = 1; i < BS->FATs; i++) {
     free(FATs[i]);
   }
   free(FATs);
 
+  if (!consistent) {
+    volumeClose(volume);
+    return NULL;
+  }
+
   uint32_t root_in_bytes = BS->max_files_in_root * sizeof(FileEntry_t);
   uint32_t root_in_sectors = root_in_bytes / BS->bytes_per_sector;
-  FileEntry_t *rootEntries = calloc(BS->max_files_in_root, sizeof(FileEntry_t));
+  uint64_t root_offset = FAT_offset + (uint64_t)BS->FATs * FAT_in_bytes;
+  volume->rootEntries = calloc(BS->max_files_in_root, sizeof(FileEntry_t));
 
-  if (rootEntries == NULL) {
-    free(FAT);
-    free(BS);
-    fclose(diskFile);
+  if (volume->rootEntries == NULL) {
+    volumeClose(volume);
     printf("Couldn't allocate memory\n");
-    return 1;
+    return NULL;
   }
 
-  fread(rootEntries, root_in_bytes, 1, diskFile);
+  imageRead(image, volume->rootEntries, root_in_bytes, root_offset);
 
-  uint32_t loaded_sectors = 1 + (BS->FATs * BS->size_of_FAT) + root_in_sectors;
+  uint32_t loaded_sectors = BS->reserved_area + (BS->FATs * BS->size_of_FAT) + root_in_sectors;
   uint32_t remaining_sectors = number_of_sectors - loaded_sectors;
   uint32_t remaining_entries = (remaining_sectors * BS->bytes_per_sector) / sizeof(FileEntry_t);
-  FileEntry_t *dataSection = calloc(remaining_entries, sizeof(FileEntry_t));
+  volume->dataOffset = (uint64_t)loaded_sectors * BS->bytes_per_sector;
+  resolveGeometry(volume);
 
-  if (dataSection == NULL) {
-    free(FAT);
-    free(BS);
-    free(rootEntries);
-    fclose(diskFile);
-    printf("Couldn't allocate memory\n");
-    return 1;
+  if (image->format == image_raw && options.lazy && !options.noReadahead && image->overlayFd < 0) {
+    volume->readahead = readaheadCreate(image->fd);
+  } else if (image->format == image_raw && !options.lazy && image->overlayFd < 0) {
+    // compressed images are decompressed on demand, cluster by cluster, and so is an image with an
+    // overlay so opening a session doesn't read the whole of it
+    volume->dataSection = calloc(remaining_entries, sizeof(FileEntry_t));
+    if (volume->dataSection == NULL) {
+      volumeClose(volume);
+      printf("Couldn't allocate memory\n");
+      return NULL;
+    }
+    imageRead(image, volume->dataSection, (uint64_t)remaining_sectors * BS->bytes_per_sector, volume->dataOffset);
   }
 
-  fread(dataSection, BS->bytes_per_sector, remaining_sectors, diskFile);
+  if (!buildEntryTable(volume)) {
+    printf("Couldn't read the directory tree\n");
+    volumeClose(volume);
+    return NULL;
+  }
 
-  global_data.FAT = FAT;
-  global_data.dataSection = dataSection;
-  global_data.rootEntries = rootEntries;
+  return volume;
+}
 
-  fclose(diskFile);
-  return 0;
+void volumeClose(Volume_t *volume) {
+  if (volume == NULL) {
+    return;
+  }
+  free(volume->FAT);
+  free(volume->dataSection);
+  free(volume->rootEntries);
+  free(volume->BS);
+  free(volume->dirty);
+  releaseChanged(volume);
+  freeEntryTable(&volume->table);
+  readaheadDestroy(volume->readahead);
+  imageClose(volume->image);
+  pthread_mutex_destroy(&volume->lock);
+  free(volume);
+}
+
+int loadDiskImage(const char *name) {
+  global_data.diskFilename = name;
+  global_data.volume = volumeOpen(name, global_data.options);
+  return global_data.volume == NULL;
 }
 
 void initGUI(void) {
   char buffer[BUFFER_SIZE];
-  printf("Type 'help' for a list of available commands\n");
+  // with json output there's no prompt, so commands can be piped in and the output parsed as is
+  bool prompt = !global_data.options.json;
+  prompt && printf("Type 'help' for a list of available commands\n");
   while (true) {
     memset(buffer, 0, BUFFER_SIZE);
-    printf(GREEN "%s" RESET ":" CYAN, global_data.diskFilename);
-    printCurrentDirectory();
-    printf(RESET "> ");
-    fgets(buffer, BUFFER_SIZE, stdin);
+    if (prompt) {
+      printf(GREEN "%s" RESET ":" CYAN, global_data.diskFilename);
+      printCurrentDirectory();
+      printf(RESET "> ");
+    }
+    if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+      break;
+    }
     uint32_t length = strlen(buffer);
-    if (buffer[length - 1] == '\n') {
+    if (length > 0 && buffer[length - 1] == '\n') {
       buffer[length - 1] = 0;
     } else {
-      while (getchar() != '\n');
+      int c;
+      while ((c = getchar()) != '\n' && c != EOF);
     }
     if (strcmp("exit", buffer) == 0) {
       break;
@@ -131,10 +218,11 @@ void initGUI(void) {
 }
 
 void freeResources(void) {
-  free(global_data.FAT);
-  free(global_data.dataSection);
-  free(global_data.rootEntries);
-  free(global_data.BS);
+  if (global_data.volume != NULL && global_data.volume->dirtySectors > 0) {
+    printf("%u changed sectors weren't flushed to %s.\n", global_data.volume->dirtySectors, changesTarget(global_data.volume));
+  }
+  volumeClose(global_data.volume);
+  global_data.volume = NULL;
 }
 
 static void makeHistoryBackup(void) {
@@ -261,6 +349,92 @@ File_t *fileOpen(char *filename) {
   return handle;
 }
 
+File_t *fileOpenEntry(const FileEntry_t *entry) {
+  // opens an entry returned by fileReadDirectoryEntry(), NULL opens the root directory
+  File_t *handle = calloc(1, sizeof(File_t));
+  if (handle == NULL) {
+    return NULL;
+  }
+  handle->_type = directory;
+  handle->_opened = true;
+  if (entry != NULL) {
+    handle->_self = *entry;
+    handle->_entry = &handle->_self;
+    handle->_type = is_directory(entry) ? directory : file;
+    handle->_size = entry->file_size;
+  }
+  return handle;
+}
+
+File_t *fileOpenAt(File_t *parent, const char *path) {
+  // like fileOpen() but relative to an open directory instead of the working directory,
+  // absolute paths start from the root and .. isn't supported since handles don't know their parent
+  if (!parent || !parent->_opened || parent->_type != directory || path == NULL) {
+    return NULL;
+  }
+  char *dup = strdup(path);
+  if (dup == NULL) {
+    return NULL;
+  }
+  // the parent's entries are cached, so opening many of its children costs one scan each
+  FileEntry_t *entries = *path == '/' ? global_data.volume->rootEntries : directoryEntries(parent);
+  uint32_t capacity = *path == '/' ? directoryCapacity(global_data.volume, NULL) : parent->_capacity;
+  bool owned = false;
+  FileEntry_t current;
+  bool found_any = false;
+  bool found = entries != NULL;
+  char *saveptr = NULL;
+  for (char *chunk = strtok_r(dup, "/", &saveptr); found && chunk != NULL; chunk = strtok_r(NULL, "/", &saveptr)) {
+    if (strcmp(chunk, ".") == 0) {
+      continue;
+    }
+    if (found_any) {
+      // going deeper, the previous component has to be a directory
+      if (owned) {
+        free(entries);
+      }
+      entries = is_directory(&current) ? (FileEntry_t *)getContents(global_data.volume, &current) : NULL;
+      capacity = entries ? directoryCapacity(global_data.volume, &current) : 0;
+      owned = true;
+    }
+    found = entries != NULL && strcmp(chunk, "..") != 0 && lookupEntry(entries, capacity, chunk, &current);
+    found_any = true;
+  }
+  if (owned) {
+    free(entries);
+  }
+  free(dup);
+  if (!found) {
+    return NULL;
+  }
+  if (!found_any) {
+    // the path named the directory itself
+    return *path == '/' ? fileOpenEntry(NULL) : fileOpenEntry(parent->_entry);
+  }
+  return fileOpenEntry(&current);
+}
+
+static FileEntry_t *directoryEntries(File_t *handle) {
+  if (handle->_entries == NULL) {
+    handle->_entries = (FileEntry_t *)getContents(global_data.volume, handle->_entry);
+    handle->_capacity = handle->_entries ? directoryCapacity(global_data.volume, handle->_entry) : 0;
+  }
+  return handle->_entries;
+}
+
+static bool lookupEntry(FileEntry_t *entries, uint32_t capacity, const char *name, FileEntry_t *found) {
+  uint8_t packed[11];
+  if (!packName(name, packed)) {
+    return false;
+  }
+  int32_t index = scanEntries(entries, capacity, packed, HIDDEN_FILE | LONG_FILENAME);
+  if (index < 0) {
+    return false;
+  }
+  *found = entries[index];
+  return true;
+}
+
 int32_t fileRead(char *buffer, size_t size, size_t items, File_t *handle) {
   // returns bytes read on success, FILE_ERROR on error, or FILE_END if reached the EOF
   if (!handle || !handle->_opened || !buffer || handle->_type == directory) {
@@ -278,7 +452,7 @@ int32_t fileRead(char *buffer, size_t size, size_t items, File_t *handle) {
   if (to_read > remaining_bytes) {
     to_read = remaining_bytes;
   }
-  uint8_t *contents = getContents(handle->_entry);
+  uint8_t *contents = getContents(global_data.volume, handle->_entry);
   if (contents == NULL) {
     return FILE_ERROR;
   }
@@ -298,39 +472,34 @@ int32_t fileReadChar(File_t *handle) {
 }
 
 int32_t fileReadDirectory(char *buffer, File_t *handle) {
-  static int lastIndex = 0;
+  // copies the next entry's name to buffer (13 bytes), returns 0 or FILE_END after the last one
+  FileEntry_t entry;
+  int32_t result = fileReadDirectoryEntry(handle, &entry);
+  if (result != 0) {
+    return result;
+  }
+  formatFilename(&entry, buffer);
+  return 0;
+}
+
+int32_t fileReadDirectoryEntry(File_t *handle, FileEntry_t *entry) {
+  // the next entry of a directory, it can be opened with fileOpenEntry() without another lookup
+  // every handle keeps its own position, FILE_END rewinds it
   if (!handle || !handle->_opened || handle->_type != directory) {
     return FILE_ERROR;
   }
-  FileEntry_t *entry = handle->_entry;
-  FileEntry_t *entries = (FileEntry_t *)getContents(entry);
+  FileEntry_t *entries = directoryEntries(handle);
   if (entries == NULL) {
     return FILE_ERROR;
   }
-  for (size_t i = 0, entryIndex = 0; true; i++) {
-    FileEntry_t entry = entries[i];
-    if (lastEntry(&entry)) {
-      break;
-    }
-    if (skippable(&entry)) {
-      continue;
-    }
-    if (entryIndex <= lastIndex) {
-      entryIndex++;
-      continue;
-    }
-    char *filename = getFilename(&entry);
-    if (filename == NULL) {
-      free(entries);
-      return FILE_ERROR;
+  while (handle->_index < handle->_capacity && !lastEntry(&entries[handle->_index])) {
+    FileEntry_t *current = &entries[handle->_index++];
+    if (!skippable(current)) {
+      *entry = *current;
+      return 0;
     }
-    strcpy(buffer, filename);
-    free(filename);
-    lastIndex++;
-    return 0;
   }
-  free(entries);
-  lastIndex = 0;
+  handle->_index = 0;
   return FILE_END;
 }
 
@@ -373,12 +542,15 @@ void fileClose(File_t *handle) {
     return;
   }
   handle->_opened = false;
+  if (handle->_entry != NULL) {
+    // the root directory's entries belong to the volume
+    free(handle->_entries);
+  }
   free(handle);
 }
 
-static char *getFilename(FileEntry_t *entry) {
-  char *buffer = calloc(13, sizeof(uint8_t));
-  if (!buffer) return NULL;
+static void formatFilename(FileEntry_t *entry, char *buffer) {
+  // buffer must hold at least 13 characters
   uint32_t index = 0;
   for (int i = 0; i < sizeof(entry->filename); i++) {
     if (entry->filename[i] == ' ') break;
@@ -386,24 +558,21 @@ static char *getFilename(FileEntry_t *entry) {
   }
   if (entry->extension[0] == ' ') {
     // there's no extension
-    return buffer;
+    buffer[index] = 0;
+    return;
   }
   buffer[index++] = '.';
   for (int i = 0; i < sizeof(entry->extension); i++) {
     if (entry->extension[i] == ' ') break;
     buffer[index++] = tolower(entry->extension[i]);
   }
-  return buffer;
+  buffer[index] = 0;
 }
 
 static void printFilename(FileEntry_t *entry) {
-  char *name = getFilename(entry);
-  if (name == NULL) {
-    printf("Couldn't read the filename!\n");
-    return;
-  }
+  char name[13];
+  formatFilename(entry, name);
   printf("%s", name);
-  free(name);
 }
 
 static FileEntry_t *getDirectory(uint32_t index) {
@@ -444,8 +613,136 @@ static uint16_t get_fat_entry(uint8_t *FAT, uint16_t index) {
   return (index & 0x0001) ? (entry_value >> 4) : (entry_value & 0x0fff);
 }
 
-static uint32_t countFATentries(FileEntry_t *entry) {
-  uint8_t *FAT = global_data.FAT;
+static void set_fat_entry(uint8_t *FAT, uint16_t index, uint16_t value) {
+  uint16_t *entry_address = (uint16_t *)&FAT[index + (index / 2)];
+  if (index & 0x0001) {
+    *entry_address = (*entry_address & 0x000f) | (value << 4);
+  } else {
+    *entry_address = (*entry_address & 0xf000) | (value & 0x0fff);
+  }
+}
+
+static uint32_t nextMismatch(const uint8_t *a, const uint8_t *b, uint32_t size, uint32_t offset) {
+  // offset of the first 64 byte block at or after offset where a and b differ, size if there's none
+#ifdef __SSE2__
+  for (; offset + 64 <= size; offset += 64) {
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + offset)), _mm_loadu_si128((const __m128i *)(b + offset)));
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + offset + 16)), _mm_loadu_si128((const __m128i *)(b + offset + 16)));
+    __m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + offset + 32)), _mm_loadu_si128((const __m128i *)(b + offset + 32)));
+    __m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + offset + 48)), _mm_loadu_si128((const __m128i *)(b + offset + 48)));
+    __m128i any = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff) {
+      break;
+    }
+  }
+#else
+  for (; offset + 64 <= size; offset += 64) {
+    uint64_t any = 0;
+    for (int i = 0; i < 64; i += 8) {
+      uint64_t x, y;
+      memcpy(&x, a + offset + i, sizeof(x));
+      memcpy(&y, b + offset + i, sizeof(y));
+      any |= x ^ y;
+    }
+    if (any != 0) {
+      break;
+    }
+  }
+#endif
+  if (offset + 64 > size && offset < size && memcmp(a + offset, b + offset, size - offset) == 0) {
+    return size;
+  }
+  return offset < size ? offset : size;
+}
+
+static bool checkFATCopies(uint8_t **FATs, uint32_t copies, uint32_t size, enum fat_policy policy) {
+  // compares every FAT copy with the primary one and, depending on the policy, repairs
+  // the primary FAT in place. returns false if the image shouldn't be used
+  uint32_t entries = size / 3 * 2;
+  uint32_t differing[copies];
+  uint32_t total = 0, repaired = 0, listed = 0;
+  memset(differing, 0, sizeof(differing));
+  // repairs go to a separate buffer so every copy is compared with the primary FAT as it was read
+  uint8_t *resolved = NULL;
+  if (policy == fat_majority && copies > 2 && (resolved = malloc(size)) != NULL) {
+    memcpy(resolved, FATs[0], size);
+  }
+  for (uint32_t copy = 1; copy < copies; copy++) {
+    uint32_t offset = 0;
+    uint32_t counted = 0; // entries below this one were already looked at
+    while ((offset = nextMismatch(FATs[0], FATs[copy], size, offset)) < size) {
+      // the block may differ only in entries of other copies, check the entries it covers
+      uint32_t block_end = MIN(offset + 64, size);
+      uint32_t first = MAX(offset * 2 / 3 - (offset >= 3), counted);
+      uint32_t last = MIN(block_end * 2 / 3 + 1, entries);
+      for (uint32_t i = first; i < last; i++) {
+        uint16_t primary = get_fat_entry(FATs[0], i);
+        uint16_t other = get_fat_entry(FATs[copy], i);
+        if (primary == other) {
+          continue;
+        }
+        if (total == 0) {
+          printf("Warning: the FAT copies don't match\n");
+        }
+        differing[copy]++;
+        total++;
+        if (listed < FAT_MISMATCHES_SHOWN) {
+          printf("  entry %u: 0x%.3hx in FAT 1, 0x%.3hx in FAT %u\n", i, primary, other, copy + 1);
+          listed++;
+        }
+        if (resolved != NULL) {
+          // the value most copies agree on wins, ties keep the primary value
+          uint16_t best = primary;
+          uint32_t best_votes = 0;
+          for (uint32_t candidate = 0; candidate < copies; candidate++) {
+            uint16_t value = get_fat_entry(FATs[candidate], i);
+            uint32_t votes = 0;
+            for (uint32_t voter = 0; voter < copies; voter++) {
+              votes += get_fat_entry(FATs[voter], i) == value;
+            }
+            if (votes > best_votes) {
+              best = value;
+              best_votes = votes;
+            }
+          }
+          if (best != primary && get_fat_entry(resolved, i) != best) {
+            set_fat_entry(resolved, i, best);
+            repaired++;
+          }
+        }
+      }
+      counted = last;
+      offset = block_end;
+    }
+  }
+  if (resolved != NULL) {
+    memcpy(FATs[0], resolved, size);
+    free(resolved);
+  }
+  if (total == 0) {
+    return true;
+  }
+  if (listed < total) {
+    printf("  ...\n");
+  }
+  for (uint32_t copy = 1; copy < copies; copy++) {
+    printf("  FAT %u differs from FAT 1 in %u of %u entries (%.2lf%%)\n", copy + 1, differing[copy], entries,
+           (double)differing[copy] / entries * 100.00);
+  }
+  if (policy == fat_fail) {
+    printf("Refusing to use an image with inconsistent FATs\n");
+    return false;
+  }
+  if (policy == fat_majority) {
+    printf("Using the majority vote for every entry (%u entries taken from other copies)\n", repaired);
+  } else {
+    printf("Using the primary FAT\n");
+  }
+  return true;
+}
+
+static uint32_t countFATentries(Volume_t *volume, FileEntry_t *entry) {
+  uint8_t *FAT = volume->FAT;
   uint16_t FAT_entry = entry->first_cluster_address_low;
   uint32_t counter = 0;
   while (!(last_entry(FAT_entry) || bad_entry(FAT_entry))) {
@@ -455,47 +752,85 @@ static uint32_t countFATentries(FileEntry_t *entry) {
   return counter;
 }
 
-static uint8_t *getContents(FileEntry_t *entry) {
+static bool chainReadable(Volume_t *volume, uint16_t cluster) {
+  // whether the chain stays inside the data area and ends properly, so it can be followed safely
+  uint32_t guard = volume->geometry.clusterLimit;
+  while (used_entry(cluster) && cluster < volume->geometry.clusterLimit && guard-- > 0) {
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+  return last_entry(cluster);
+}
+
+static uint8_t *getContents(Volume_t *volume, FileEntry_t *entry) {
   // fetches whatever contents the entry is pointing to
   if (entry == NULL) {
     // it's the root directory
-    return (uint8_t *)global_data.rootEntries;
+    return (uint8_t *)volume->rootEntries;
   }
   bool isDirectory = is_directory(entry);
-  uint8_t *FAT = global_data.FAT;
-  BootSector_t *BS = global_data.BS;
-  uint32_t cluster_size = BS->bytes_per_sector * BS->sectors_per_cluster;
+  uint8_t *FAT = volume->FAT;
+  uint32_t cluster_size = volume->geometry.clusterSize;
   uint16_t FAT_index = entry->first_cluster_address_low;
   uint32_t remaining_data = entry->file_size;
   uint8_t *contents;
-  uint32_t temp;
   if (isDirectory) {
-    uint32_t clusters = countFATentries(entry);
-    contents = calloc(clusters * cluster_size, sizeof(uint8_t));
+    remaining_data = countFATentries(volume, entry) * cluster_size;
+    contents = calloc(remaining_data, sizeof(uint8_t));
   } else {
     contents = calloc(entry->file_size + 1, sizeof(uint8_t));
   }
   if (!contents) {
     return NULL;
   }
-  uint8_t *start = (uint8_t *)global_data.dataSection;
+  if (volume->dataSection != NULL && volume->geometry.copyChain != NULL) {
+    // common geometries have a copy loop specialized for their cluster size
+    if (!volume->geometry.copyChain(volume, FAT_index, contents, remaining_data)) {
+      free(contents);
+      return NULL;
+    }
+    return contents;
+  }
+  bool shared = volume->dataSection == NULL;
+  if (shared) {
+    // the image (its cache or the readahead queue) can only be used by one reader at a time
+    pthread_mutex_lock(&volume->lock);
+  }
   uint32_t data_read = 0;
   uint16_t FAT_entry_value = FAT_index;
+  // clusters that follow each other on disk are read as one extent
+  uint16_t run_start = 0;
+  uint32_t run_offset = 0;
+  uint32_t run_length = 0;
+  bool failed = false;
   while (true) {
     if (bad_entry(FAT_entry_value)) {
-      free(contents);
-      return NULL;
+      failed = true;
+      break;
     }
     if (isDirectory && last_entry(FAT_entry_value)) {
       break;
     }
-    uint32_t offset = (FAT_entry_value - 2) * cluster_size;
-    uint8_t *content_ptr = start + offset;
+    if (!isDirectory && remaining_data == 0) {
+      break;
+    }
+    if (!used_entry(FAT_entry_value) || FAT_entry_value >= volume->geometry.clusterLimit) {
+      failed = true;
+      break;
+    }
     uint32_t to_read = remaining_data > cluster_size ? cluster_size : remaining_data;
     if (isDirectory) {
       to_read = cluster_size;
     }
-    memcpy(contents + data_read, content_ptr, to_read);
+    bool contiguous = FAT_entry_value == run_start + run_length / cluster_size;
+    if (run_length != 0 && (!contiguous || run_length + to_read > READAHEAD_MAX_EXTENT)) {
+      failed = failed || !readExtent(volume, run_start, contents + run_offset, run_length);
+      run_length = 0;
+    }
+    if (run_length == 0) {
+      run_start = FAT_entry_value;
+      run_offset = data_read;
+    }
+    run_length += to_read;
     data_read += to_read;
     remaining_data -= to_read;
     if (last_entry(FAT_entry_value)) {
@@ -503,9 +838,327 @@ static uint8_t *getContents(FileEntry_t *entry) {
     }
     FAT_entry_value = get_fat_entry(FAT, FAT_entry_value);
   }
+  if (run_length != 0) {
+    failed = failed || !readExtent(volume, run_start, contents + run_offset, run_length);
+  }
+  if (volume->readahead != NULL && readaheadWait(volume->readahead) != 0) {
+    failed = true;
+  }
+  if (shared) {
+    pthread_mutex_unlock(&volume->lock);
+  }
+  if (failed) {
+    free(contents);
+    return NULL;
+  }
   return contents;
 }
 
+// copy loops with the cluster size known at compile time, the offset of a cluster is a shift,
+// single clusters are copied with constant length moves and contiguous runs with one memcpy
+static inline void copyCluster(uint8_t *destination, const uint8_t *source, uint32_t size) {
+  // size is a constant multiple of 64 once inlined, the loop becomes plain vector moves
+  // instead of the rep movs a single constant length memcpy turns into
+  for (uint32_t i = 0; i < size; i += 64) {
+    memcpy(destination + i, source + i, 64);
+  }
+}
+
+#define DEFINE_COPY_CHAIN(shift) \
+  static bool copyChain##shift(Volume_t *volume, uint16_t cluster, uint8_t *destination, uint32_t size) { \
+    const uint8_t *data = (const uint8_t *)volume->dataSection; \
+    uint8_t *FAT = volume->FAT; \
+    uint32_t limit = volume->geometry.clusterLimit; \
+    while (size >= (1u << shift)) { \
+      if (!used_entry(cluster) || cluster >= limit) { \
+        return false; \
+      } \
+      const uint8_t *source = data + ((uint32_t)(cluster - 2) << shift); \
+      uint16_t last = cluster; \
+      uint16_t next = get_fat_entry(FAT, cluster); \
+      uint32_t run = 1; \
+      while (next == last + 1 && next < limit && ((run + 1) << shift) <= size) { \
+        last = next; \
+        next = get_fat_entry(FAT, next); \
+        run++; \
+      } \
+      if (run == 1) { \
+        copyCluster(destination, source, 1u << shift); \
+      } else { \
+        memcpy(destination, source, run << shift); \
+      } \
+      destination += run << shift; \
+      size -= run << shift; \
+      cluster = next; \
+    } \
+    if (size != 0) { \
+      if (!used_entry(cluster) || cluster >= limit) { \
+        return false; \
+      } \
+      memcpy(destination, data + ((uint32_t)(cluster - 2) << shift), size); \
+    } \
+    return true; \
+  }
+
+DEFINE_COPY_CHAIN(9)
+DEFINE_COPY_CHAIN(10)
+DEFINE_COPY_CHAIN(11)
+DEFINE_COPY_CHAIN(12)
+DEFINE_COPY_CHAIN(13)
+DEFINE_COPY_CHAIN(14)
+DEFINE_COPY_CHAIN(15)
+
+static void resolveGeometry(Volume_t *volume) {
+  // works out the volume layout once and picks a specialized copy loop if there's one
+  static const copy_chain_t copyChains[] = {copyChain9, copyChain10, copyChain11, copyChain12, copyChain13, copyChain14, copyChain15};
+  BootSector_t *BS = volume->BS;
+  struct geometry_t *geometry = &volume->geometry;
+  uint32_t number_of_sectors = MAX(BS->number_of_sectors_2b, BS->number_of_sectors_4b);
+  geometry->bytesPerSector = BS->bytes_per_sector;
+  geometry->sectorsPerCluster = BS->sectors_per_cluster;
+  geometry->clusterSize = BS->bytes_per_sector * BS->sectors_per_cluster;
+  geometry->clusterCount = (number_of_sectors * (uint64_t)BS->bytes_per_sector - volume->dataOffset) / geometry->clusterSize;
+  geometry->sectorCount = number_of_sectors;
+  geometry->FATOffset = (uint64_t)BS->reserved_area * BS->bytes_per_sector;
+  geometry->FATSize = BS->size_of_FAT * BS->bytes_per_sector;
+  geometry->FATCopies = BS->FATs;
+  geometry->rootOffset = geometry->FATOffset + (uint64_t)BS->FATs * geometry->FATSize;
+  geometry->rootSize = BS->max_files_in_root * sizeof(FileEntry_t);
+  // clusters past the end of the data area or the FAT don't exist
+  geometry->clusterLimit = MIN(2 + geometry->clusterCount, MIN(MAX_CLUSTERS, geometry->FATSize * 2 / 3));
+  geometry->clusterShift = 0;
+  geometry->copyChain = NULL;
+  geometry->name = "generic";
+  if ((geometry->clusterSize & (geometry->clusterSize - 1)) == 0) {
+    while ((1u << geometry->clusterShift) < geometry->clusterSize) {
+      geometry->clusterShift++;
+    }
+    if (geometry->clusterShift >= 9 && geometry->clusterShift <= 15) {
+      geometry->copyChain = copyChains[geometry->clusterShift - 9];
+      geometry->name = "power of two clusters";
+    }
+  }
+  if (number_of_sectors == 2880 && BS->bytes_per_sector == 512 && BS->sectors_per_cluster == 1) {
+    geometry->name = "1.44MB floppy";
+  }
+}
+
+static bool readExtent(Volume_t *volume, uint16_t cluster, uint8_t *destination, uint32_t size) {
+  // copies size bytes starting at a data cluster, either from memory or straight from the image
+  // with readahead the read is only submitted, getContents() waits for all of them at the end
+  uint64_t offset = (uint64_t)(cluster - 2) * volume->geometry.clusterSize;
+  if (cluster < 2 || offset + size > (uint64_t)(volume->geometry.clusterLimit - 2) * volume->geometry.clusterSize) {
+    // a corrupt chain pointing past the data area
+    return false;
+  }
+  if (volume->dataSection != NULL) {
+    memcpy(destination, (uint8_t *)volume->dataSection + offset, size);
+    return true;
+  }
+  if (volume->changed == NULL) {
+    return readData(volume, offset, destination, size);
+  }
+  // clusters changed since the last flush come from their copies, the runs in between from the image
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t done = 0;
+  while (done < size) {
+    uint8_t *copy = volume->changed[cluster + done / cluster_size];
+    uint32_t length = MIN(cluster_size, size - done);
+    if (copy != NULL) {
+      memcpy(destination + done, copy, length);
+      done += length;
+      continue;
+    }
+    while (done + length < size && volume->changed[cluster + (done + length) / cluster_size] == NULL) {
+      length += MIN(cluster_size, size - done - length);
+    }
+    if (!readData(volume, offset + done, destination + done, length)) {
+      return false;
+    }
+    done += length;
+  }
+  return true;
+}
+
+static bool readData(Volume_t *volume, uint64_t offset, uint8_t *destination, uint32_t size) {
+  // offset is relative to the data area, which isn't loaded
+  if (volume->readahead != NULL) {
+    return readaheadSubmit(volume->readahead, volume->dataOffset + offset, destination, size) == 0;
+  }
+  return imageRead(volume->image, destination, size, volume->dataOffset + offset) == size;
+}
+
+static void dumpLine(char *line, const uint8_t *data, uint32_t count, uint64_t offset) {
+  // fills in a line made of spaces, count is at most 16 and every byte past it is left blank
+  static const char hex[] = "0123456789abcdef";
+  for (int i = 7; i >= 0; i--) {
+    line[i] = hex[offset & 0xf];
+    offset >>= 4;
+  }
+#ifdef __SSE2__
+  if (count == 16) {
+    // both nibbles of every byte become digits at once, '0' + n with 'a' - '0' - 10 more above 9
+    __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i digit = _mm_set1_epi8('0');
+    __m128i letter = _mm_set1_epi8('a' - '0' - 10);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+    __m128i low = _mm_and_si128(bytes, nibble);
+    high = _mm_add_epi8(_mm_add_epi8(high, digit), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letter));
+    low = _mm_add_epi8(_mm_add_epi8(low, digit), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letter));
+    char digits[32];
+    _mm_storeu_si128((__m128i *)digits, _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128((__m128i *)(digits + 16), _mm_unpackhi_epi8(high, low));
+    for (int i = 0; i < 16; i++) {
+      memcpy(line + DUMP_HEX_COLUMN + 3 * i + (i >= 8), digits + 2 * i, 2);
+    }
+    // bytes above 0x7e compare as negative, so one signed range check finds the printable ones
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+    __m128i ascii = _mm_or_si128(_mm_and_si128(printable, bytes), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+    _mm_storeu_si128((__m128i *)(line + DUMP_ASCII_COLUMN), ascii);
+    return;
+  }
+#endif
+  for (uint32_t i = 0; i < count; i++) {
+    char *position = line + DUMP_HEX_COLUMN + 3 * i + (i >= 8);
+    position[0] = hex[data[i] >> 4];
+    position[1] = hex[data[i] & 0xf];
+    line[DUMP_ASCII_COLUMN + i] = data[i] >= 0x20 && data[i] < 0x7f ? data[i] : '.';
+  }
+}
+
+static void dump(Output_t *output, const uint8_t *data, uint32_t size, uint64_t offset) {
+  // offset is what the first byte is labelled with, lines are formatted in place and copied to output
+  char line[DUMP_LINE_SIZE];
+  memset(line, ' ', sizeof(line));
+  line[DUMP_ASCII_COLUMN - 1] = '|';
+  line[DUMP_LINE_SIZE - 2] = '|';
+  line[DUMP_LINE_SIZE - 1] = '\n';
+  uint32_t done = 0;
+  for (; done + 16 <= size; done += 16) {
+    dumpLine(line, data + done, 16, offset + done);
+    outputWrite(output, line, sizeof(line));
+  }
+  if (done < size) {
+    // the last line is cut short after its ascii column
+    uint32_t count = size - done;
+    memset(line + DUMP_HEX_COLUMN, ' ', DUMP_ASCII_COLUMN - 1 - DUMP_HEX_COLUMN);
+    dumpLine(line, data + done, count, offset + done);
+    line[DUMP_ASCII_COLUMN + count] = '|';
+    line[DUMP_ASCII_COLUMN + count + 1] = '\n';
+    outputWrite(output, line, DUMP_ASCII_COLUMN + count + 2);
+  }
+}
+
+static bool dumpImage(Output_t *output, Volume_t *volume, uint64_t position, uint64_t size, uint64_t offset) {
+  // dumps size bytes of the image starting at position, labelled from offset, in chunks
+  if (size == 0) {
+    return true;
+  }
+  uint8_t *chunk = malloc(MIN(size, DUMP_CHUNK));
+  if (chunk == NULL) {
+    return false;
+  }
+  bool success = true;
+  for (uint64_t done = 0; success && done < size;) {
+    uint32_t length = MIN(size - done, DUMP_CHUNK);
+    success = imageRead(volume->image, chunk, length, position + done) == length;
+    if (success) {
+      dump(output, chunk, length, offset + done);
+      done += length;
+    }
+  }
+  free(chunk);
+  return success;
+}
+
+static bool parseNumber(const char *argument, uint64_t *value) {
+  // decimal, or hexadecimal with 0x
+  char *end;
+  errno = 0;
+  *value = strtoull(argument, &end, 0);
+  return *argument != '\0' && *argument != '-' && *end == '\0' && errno == 0;
+}
+
+static void dumpCommand(char **arguments, int count) {
+  // dump sector <n> [count] | cluster <n> [count] | file <path> [offset length], shows the image as it's stored
+  Volume_t *volume = global_data.volume;
+  struct geometry_t *geometry = &volume->geometry;
+  uint64_t first, amount = 1;
+  if (count < 2 || (strcmp(arguments[0], "file") != 0 && (!parseNumber(arguments[1], &first) || (count > 2 && !parseNumber(arguments[2], &amount))))) {
+    printf("  Usage: dump sector <n> [count] | dump cluster <n> [count] | dump file <path> [offset length]\n");
+    return;
+  }
+  uint64_t position, size, offset;
+  struct extent_t *extents = NULL;
+  uint32_t extent_count = 0;
+  if (strcmp(arguments[0], "sector") == 0) {
+    if (first >= geometry->sectorCount || amount > geometry->sectorCount - first) {
+      printf("  The image has %u sectors.\n", geometry->sectorCount);
+      return;
+    }
+    position = offset = first * geometry->bytesPerSector;
+    size = amount * geometry->bytesPerSector;
+  } else if (strcmp(arguments[0], "cluster") == 0) {
+    if (first < 2 || first >= geometry->clusterLimit || amount > geometry->clusterLimit - first) {
+      printf("  Clusters go from 2 to %u.\n", geometry->clusterLimit - 1);
+      return;
+    }
+    position = offset = volume->dataOffset + (first - 2) * geometry->clusterSize;
+    size = amount * geometry->clusterSize;
+  } else if (strcmp(arguments[0], "file") == 0) {
+    char path[PATH_SIZE];
+    if (arguments[1][0] == '/') {
+      snprintf(path, sizeof(path), "%s", arguments[1]);
+    } else {
+      formatCurrentDirectory(path, sizeof(path));
+      snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", arguments[1]);
+    }
+    int32_t row = volumeLookup(volume, path);
+    if (row < 0 || (volume->table.attributes[row] & DIRECTORY)) {
+      printf("  %s isn't a file.\n", arguments[1]);
+      return;
+    }
+    uint64_t length = volume->table.size[row];
+    offset = 0;
+    if (count > 2 && (!parseNumber(arguments[2], &offset) || (count > 3 && !parseNumber(arguments[3], &length)))) {
+      printf("  Invalid offset or length.\n");
+      return;
+    }
+    // only the clusters holding the range are read, straight from where they are in the image
+    extents = volumeExtents(volume, row, MIN(offset, UINT32_MAX), MIN(length, UINT32_MAX), &extent_count);
+    if (extents == NULL) {
+      printf("  The cluster chain of %s is broken.\n", arguments[1]);
+      return;
+    }
+    position = size = 0;
+  } else {
+    printf("  Unknown dump target %s, use sector, cluster or file.\n", arguments[0]);
+    return;
+  }
+  if (volume->dirtySectors > 0) {
+    printf("  %u changed sectors aren't flushed, they are shown as they're stored.\n", volume->dirtySectors);
+  }
+  Output_t *output = outputOpen(STDOUT_FILENO);
+  if (output == NULL) {
+    printf("  Couldn't allocate memory\n");
+    free(extents);
+    return;
+  }
+  fflush(stdout);
+  bool success = extents != NULL || dumpImage(output, volume, position, size, offset);
+  for (uint32_t i = 0; success && i < extent_count; i++) {
+    success = dumpImage(output, volume, extents[i].offset, extents[i].length, offset);
+    offset += extents[i].length;
+  }
+  outputClose(output);
+  free(extents);
+  if (!success) {
+    printf("  Couldn't read the image.\n");
+  }
+}
+
 static void dumpBSInfo(BootSector_t *BS) {
   uint32_t number_of_sectors = MAX(BS->number_of_sectors_2b, BS->number_of_sectors_4b);
   printf("OEM %s\n", BS->OEM);
@@ -522,8 +1175,8 @@ static void dumpBSInfo(BootSector_t *BS) {
 }
 
 static uint32_t countRootEntries(void) {
-  FileEntry_t *rootEntries = global_data.rootEntries;
-  BootSector_t *BS = global_data.BS;
+  FileEntry_t *rootEntries = global_data.volume->rootEntries;
+  BootSector_t *BS = global_data.volume->BS;
   uint32_t counter = 0;
   for (int i = 0; i < BS->max_files_in_root; i++) {
     FileEntry_t entry = rootEntries[i];
@@ -542,91 +1195,2995 @@ static FileEntry_t *findEntry(const char *name) {
   if (name == NULL || *name == '.') {
     return NULL;
   }
+  uint8_t packed[11];
+  if (!packName(name, packed)) {
+    return NULL;
+  }
   FileEntry_t *directory = getCurrentDir();
-  FileEntry_t *dirCluster = (FileEntry_t *)getContents(directory);
+  FileEntry_t *dirCluster = (FileEntry_t *)getContents(global_data.volume, directory);
   if (dirCluster == NULL) {
     printf("Couldn't read the cluster!\n");
     return NULL;
   }
-  for (size_t i = 0; true; i++) {
-    FileEntry_t entry = dirCluster[i];
-    if (lastEntry(&entry)) {
+  // hidden and long name entries are left out, like skippable() does
+  int32_t found = scanEntries(dirCluster, directoryCapacity(global_data.volume, directory), packed, HIDDEN_FILE | LONG_FILENAME);
+  return found >= 0 ? dirCluster + found : NULL;
+}
+
+static bool packName(const char *name, uint8_t *packed) {
+  // the name the way an entry stores it, uppercase and padded with spaces, false if no entry can have it.
+  // unlike makeShortName() any character is let through, entries written by other tools may have them
+  const char *dot = strrchr(name, '.');
+  size_t base = dot ? dot - name : strlen(name);
+  size_t extension = dot ? strlen(dot + 1) : 0;
+  if (base == 0 || base > 8 || extension > 3 || (dot && extension == 0)) {
+    return false;
+  }
+  memset(packed, ' ', 11);
+  for (size_t i = 0; i < base; i++) {
+    packed[i] = toupper((unsigned char)name[i]);
+  }
+  for (size_t i = 0; i < extension; i++) {
+    packed[8 + i] = toupper((unsigned char)dot[1 + i]);
+  }
+  // a first byte of 0xe5 marks a deleted entry
+  return packed[0] != DELETED;
+}
+
+static int32_t scanEntries(const FileEntry_t *entries, uint32_t capacity, const uint8_t *packed, uint8_t skip) {
+  // index of the first entry named packed (as packName() makes it) that has none of the skip attributes,
+  // -1 if there's none before the end of the directory. lowercase letters in entries are folded, deleted
+  // entries never match as no packed name starts with 0xe5
+#ifdef __SSE2__
+  // one load covers the name, the extension and the attributes of an entry
+  uint8_t pattern[16] = {0}, keep[16] = {0}, fold[16] = {0};
+  memcpy(pattern, packed, 11);
+  memset(keep, 0xff, 11);
+  memset(fold, 'a' - 'A', 11);
+  keep[11] = skip;
+  __m128i wanted = _mm_loadu_si128((const __m128i *)pattern);
+  __m128i kept = _mm_loadu_si128((const __m128i *)keep);
+  __m128i folded = _mm_loadu_si128((const __m128i *)fold);
+  __m128i before_a = _mm_set1_epi8('a' - 1);
+  __m128i after_z = _mm_set1_epi8('z' + 1);
+  for (uint32_t i = 0; i < capacity; i++) {
+    __m128i raw = _mm_loadu_si128((const __m128i *)&entries[i]);
+    if ((uint8_t)_mm_cvtsi128_si32(raw) == UNALLOCATED) {
       break;
     }
-    if (skippable(&entry)) {
-      continue;
+    // bytes above 0x7f compare as negative, so only a-z are lowercase
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(raw, before_a), _mm_cmpgt_epi8(after_z, raw));
+    __m128i upper = _mm_sub_epi8(raw, _mm_and_si128(lower, folded));
+    __m128i equal = _mm_cmpeq_epi8(_mm_and_si128(upper, kept), wanted);
+    if ((_mm_movemask_epi8(equal) & 0xfff) == 0xfff) {
+      return i;
+    }
+  }
+#else
+  for (uint32_t i = 0; i < capacity; i++) {
+    const uint8_t *raw = (const uint8_t *)&entries[i];
+    if (raw[0] == UNALLOCATED) {
+      break;
     }
-    char *filename = getFilename(&entry);
-    if (!filename) {
-      printf("Couldn't read the filename!\n");
+    if (raw[11] & skip) {
       continue;
     }
-    if (strcmp(name, filename) == 0) {
-      free(filename);
-      return dirCluster + i;
+    uint32_t matched = 0;
+    while (matched < 11 && toupper(raw[matched]) == packed[matched]) {
+      matched++;
+    }
+    if (matched == 11) {
+      return i;
     }
-    free(filename);
   }
-  return NULL;
+#endif
+  return -1;
 }
 
 static void printCurrentDirectory(void) {
-  for (size_t i = 0; i <= global_data.historyIndex; i++) {
-    FileEntry_t *directoryEntry = getDirectory(i);
-    if (directoryEntry == NULL) {
-      // root entry
-      printf("/");
-      continue;
-    }
-    printFilename(directoryEntry);
-    printf("/");
-  }
+  char path[PATH_SIZE];
+  formatCurrentDirectory(path, sizeof(path));
+  printf("%s", path);
 }
 
-static void printIndentation(size_t times) {
-  for (int i = 0; i < times; i++) {
-    printf("   ");
+static void formatCurrentDirectory(char *buffer, size_t size) {
+  // the path of the current directory with a trailing slash
+  size_t length = snprintf(buffer, size, "/");
+  for (size_t i = 1; i <= global_data.historyIndex && length < size; i++) {
+    char name[13];
+    formatFilename(getDirectory(i), name);
+    length += snprintf(buffer + length, size - length, "%s/", name);
   }
 }
 
-static void showDirectoryContents(FileEntry_t *directory, size_t indent, bool recursive, bool all) {
-  FileEntry_t *entries = (FileEntry_t *)getContents(directory);
+static void writeTimestampJSON(Output_t *output, const char *key, uint32_t timestamp, bool time) {
+  // ISO 8601, null when the date isn't set
+  outputFormat(output, ",\"%s\":", key);
+  if (timestamp == 0) {
+    outputString(output, "null");
+    return;
+  }
+  char buffer[32];
+  formatTimestamp(timestamp, buffer, sizeof(buffer));
+  buffer[10] = time ? 'T' : 0;
+  outputChar(output, '"');
+  outputString(output, buffer);
+  outputChar(output, '"');
+}
+
+static void writeEntryJSON(Output_t *output, FileEntry_t *entry, const char *path, bool chain) {
+  static const struct {uint8_t bit; const char *name;} attributes[] = {
+    {FILE_READ_ONLY, "read_only"}, {HIDDEN_FILE, "hidden"}, {SYSTEM_FILE, "system"}, {DIRECTORY, "directory"}, {ARCHIVE, "archive"},
+  };
+  char name[13];
+  formatFilename(entry, name);
+  uint32_t clusters;
+  uint32_t fragments = countFragments(global_data.volume, entry, &clusters);
+  outputString(output, "{\"path\":");
+  outputJSONString(output, path);
+  outputString(output, ",\"name\":");
+  outputJSONString(output, name);
+  outputString(output, is_directory(entry) ? ",\"type\":\"directory\"" : ",\"type\":\"file\"");
+  outputString(output, ",\"attributes\":[");
+  bool first = true;
+  for (int i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++) {
+    if (entry->file_attributes & attributes[i].bit) {
+      outputString(output, first ? "\"" : ",\"");
+      outputString(output, attributes[i].name);
+      outputChar(output, '"');
+      first = false;
+    }
+  }
+  outputString(output, "],\"size\":");
+  outputUnsigned(output, entry->file_size);
+  writeTimestampJSON(output, "created", fatTimestamp(entry->creation_date, entry->creation_time), true);
+  writeTimestampJSON(output, "modified", fatTimestamp(entry->modified_date, entry->modified_time), true);
+  writeTimestampJSON(output, "accessed", fatTimestamp(entry->access_date, 0), false);
+  outputString(output, ",\"first_cluster\":");
+  outputUnsigned(output, entry->first_cluster_address_low);
+  outputString(output, ",\"clusters\":");
+  outputUnsigned(output, clusters);
+  outputString(output, ",\"fragments\":");
+  outputUnsigned(output, fragments);
+  if (chain) {
+    outputString(output, ",\"chain\":[");
+    uint16_t FAT_entry = entry->first_cluster_address_low;
+    for (uint32_t i = 0; i < clusters; i++) {
+      if (i > 0) {
+        outputChar(output, ',');
+      }
+      outputUnsigned(output, FAT_entry);
+      FAT_entry = get_fat_entry(global_data.volume->FAT, FAT_entry);
+    }
+    outputChar(output, ']');
+  }
+  outputString(output, "}\n");
+}
+
+static void collectEntryJSON(FileEntry_t *entry, const char *path, uint32_t depth, void *context) {
+  writeEntryJSON(context, entry, path, false);
+}
+
+static void listDirectoryJSON(FileEntry_t *directory, bool recursive) {
+  // one line per entry, hidden ones included since their attributes say so
+  Output_t *output = outputOpen(STDOUT_FILENO);
+  char *path = malloc(PATH_SIZE);
+  if (output == NULL || path == NULL) {
+    outputClose(output);
+    free(path);
+    printf("Couldn't allocate memory\n");
+    return;
+  }
+  fflush(stdout);
+  if (recursive) {
+    path[0] = 0;
+    walkDirectory(global_data.volume, directory, path, 0, collectEntryJSON, output);
+  } else {
+    FileEntry_t *entries = (FileEntry_t *)getContents(global_data.volume, directory);
+    uint32_t capacity = entries ? directoryCapacity(global_data.volume, directory) : 0;
+    formatCurrentDirectory(path, PATH_SIZE);
+    size_t length = strlen(path);
+    for (uint32_t i = 0; i < capacity && !lastEntry(&entries[i]); i++) {
+      if (liveEntry(&entries[i])) {
+        formatFilename(&entries[i], path + length);
+        writeEntryJSON(output, &entries[i], path, false);
+      }
+    }
+    if (directory != NULL) {
+      free(entries);
+    }
+  }
+  outputClose(output);
+  free(path);
+}
+
+static void writeErrorJSON(const char *error, const char *argument) {
+  Output_t *output = outputOpen(STDOUT_FILENO);
+  if (output == NULL) {
+    return;
+  }
+  fflush(stdout);
+  outputString(output, "{\"error\":");
+  outputJSONString(output, error);
+  outputString(output, ",\"argument\":");
+  outputJSONString(output, argument);
+  outputString(output, "}\n");
+  outputClose(output);
+}
+
+static void printIndentation(size_t times) {
+  for (int i = 0; i < times; i++) {
+    printf("   ");
+  }
+}
+
+static void showDirectoryContents(FileEntry_t *directory, size_t indent, bool recursive, bool all) {
+  FileEntry_t *entries = (FileEntry_t *)getContents(global_data.volume, directory);
   if (entries == NULL) {
     printf("  Couldn't read entries cluster!\n");
     return;
   }
-  bool first_shown = false;
-  for (size_t i = 0; true; i++) {
-    FileEntry_t entry = entries[i];
-    if (lastEntry(&entry)) {
-      break;
+  bool first_shown = false;
+  uint32_t capacity = directoryCapacity(global_data.volume, directory);
+  for (uint32_t i = 0; i < capacity; i++) {
+    FileEntry_t entry = entries[i];
+    if (lastEntry(&entry)) {
+      break;
+    }
+    if (skippable(&entry)) {
+      continue;
+    }
+    if (*entry.filename == '.') {
+      // don't show . and ..
+      continue;
+    }
+    printIndentation(indent);
+    all && (printFullDate(entry.creation_time, entry.creation_date), printf("  "));
+    if (is_directory(&entry)) {
+      printf(CYAN);
+      all && printf("<DIRECTORY>");
+    } else {
+      all && printf("%u bytes", entry.file_size);
+    }
+    printf("%s", !first_shown && !all && recursive ? CYAN "  \u21B3 " RESET : "  ");
+    first_shown = true;
+    printFilename(&entry);
+    printf(RESET);
+    printf("\n");
+    if (recursive && is_directory(&entry)) {
+      showDirectoryContents(&entry, indent + 1, true, all);
+    }
+  }
+  if (directory != NULL) {
+    free(entries);
+  }
+}
+
+static uint32_t directoryCapacity(Volume_t *volume, FileEntry_t *directory) {
+  // number of entry slots a directory has
+  if (directory == NULL) {
+    return volume->BS->max_files_in_root;
+  }
+  return countFATentries(volume, directory) * volume->geometry.clusterSize / sizeof(FileEntry_t);
+}
+
+static bool liveEntry(FileEntry_t *entry) {
+  // unlike skippable() hidden files count, only entries that don't describe a file are left out
+  if (entry->allocation_status == DELETED || entry->allocation_status == UNALLOCATED) {
+    return false;
+  }
+  if ((entry->file_attributes & LONG_FILENAME) == LONG_FILENAME || (entry->file_attributes & VOLUME_LABEL)) {
+    return false;
+  }
+  return *entry->filename != '.';
+}
+
+static void walkDirectory(Volume_t *volume, FileEntry_t *directory, char *path, uint32_t depth, walk_callback_t callback, void *context) {
+  // calls back for every file and directory below directory, path holds the directory's full path
+  // and gets the entry's name appended for the duration of the call
+  FileEntry_t *entries = (FileEntry_t *)getContents(volume, directory);
+  if (entries == NULL) {
+    return;
+  }
+  uint32_t capacity = directoryCapacity(volume, directory);
+  size_t length = strlen(path);
+  for (uint32_t i = 0; i < capacity; i++) {
+    FileEntry_t *entry = &entries[i];
+    if (lastEntry(entry)) {
+      break;
+    }
+    if (!liveEntry(entry)) {
+      continue;
+    }
+    char name[13];
+    formatFilename(entry, name);
+    snprintf(path + length, PATH_SIZE - length, "/%s", name);
+    callback(entry, path, depth, context);
+    if (is_directory(entry) && depth + 1 < MAX_DEPTH && chainReadable(volume, entry->first_cluster_address_low)) {
+      walkDirectory(volume, entry, path, depth + 1, callback, context);
+    }
+    path[length] = 0;
+  }
+  if (directory != NULL) {
+    free(entries);
+  }
+}
+
+static uint32_t countFragments(Volume_t *volume, FileEntry_t *entry, uint32_t *clusters) {
+  // a fragment is a run of clusters that follow each other on disk
+  uint8_t *FAT = volume->FAT;
+  uint16_t FAT_entry = entry->first_cluster_address_low;
+  uint32_t fragments = 0;
+  *clusters = 0;
+  if (!used_entry(FAT_entry)) {
+    return 0;
+  }
+  uint16_t previous = 0;
+  while (used_entry(FAT_entry) && *clusters <= MAX_CLUSTERS) {
+    if (FAT_entry != previous + 1) {
+      fragments++;
+    }
+    (*clusters)++;
+    previous = FAT_entry;
+    FAT_entry = get_fat_entry(FAT, FAT_entry);
+  }
+  return fragments;
+}
+
+static void collectFragmentation(FileEntry_t *entry, const char *path, uint32_t depth, void *context) {
+  struct frag_report_t *report = context;
+  uint32_t clusters;
+  uint32_t fragments = countFragments(global_data.volume, entry, &clusters);
+  if (is_directory(entry)) {
+    report->directories++;
+  } else {
+    report->files++;
+  }
+  if (fragments == 0) {
+    return;
+  }
+  report->chains++;
+  report->fragments += fragments;
+  report->fragmented += fragments > 1;
+  uint32_t bucket = 0;
+  while (bucket + 1 < FRAG_BUCKETS && fragments > (1u << bucket)) {
+    bucket++;
+  }
+  report->histogram[bucket]++;
+  // keep the worst offenders sorted, most fragments first
+  for (int i = 0; i < FRAG_WORST; i++) {
+    if (fragments > report->worst[i].fragments) {
+      memmove(&report->worst[i + 1], &report->worst[i], (FRAG_WORST - i - 1) * sizeof(report->worst[0]));
+      report->worst[i].fragments = fragments;
+      report->worst[i].clusters = clusters;
+      snprintf(report->worst[i].path, PATH_SIZE, "%s", path);
+      break;
+    }
+  }
+}
+
+static void showFragmentation(void) {
+  struct frag_report_t *report = calloc(1, sizeof(struct frag_report_t));
+  char *path = calloc(PATH_SIZE, sizeof(char));
+  if (report == NULL || path == NULL) {
+    free(report);
+    free(path);
+    printf("  Couldn't allocate memory\n");
+    return;
+  }
+  walkDirectory(global_data.volume, NULL, path, 0, collectFragmentation, report);
+  printf("  %u files and %u directories\n", report->files, report->directories);
+  printf("  %u of %u cluster chains are fragmented (%.2lf%%)\n", report->fragmented, report->chains,
+         report->chains ? (double)report->fragmented / report->chains * 100.00 : 0.0);
+  printf("  %u fragments in total, %.2lf per chain\n", report->fragments,
+         report->chains ? (double)report->fragments / report->chains : 0.0);
+  printf("  Fragments per chain:\n");
+  for (int i = 0; i < FRAG_BUCKETS; i++) {
+    uint32_t low = i == 0 ? 1 : (1u << (i - 1)) + 1;
+    uint32_t high = 1u << i;
+    if (i + 1 == FRAG_BUCKETS) {
+      printf("    %5u+      %u\n", low, report->histogram[i]);
+    } else if (low == high) {
+      printf("    %5u       %u\n", low, report->histogram[i]);
+    } else {
+      printf("    %5u-%-5u %u\n", low, high, report->histogram[i]);
+    }
+  }
+  if (report->worst[0].fragments > 1) {
+    printf("  Most fragmented:\n");
+  }
+  for (int i = 0; i < FRAG_WORST && report->worst[i].fragments > 1; i++) {
+    printf("    %s - %u fragments, %u clusters\n", report->worst[i].path, report->worst[i].fragments, report->worst[i].clusters);
+  }
+  free(report);
+  free(path);
+}
+
+static bool defragAllocate(struct defrag_t *defrag, uint32_t clusters, uint16_t *first) {
+  // hands out the next run of clusters, skipping the ones marked as bad
+  uint32_t start = defrag->next;
+  while (true) {
+    if (start + clusters > defrag->clusterLimit) {
+      return false;
+    }
+    uint32_t i = 0;
+    while (i < clusters && !bad_entry(get_fat_entry(global_data.volume->FAT, start + i))) {
+      i++;
+    }
+    if (i == clusters) {
+      break;
+    }
+    start += i + 1;
+  }
+  for (uint32_t i = 0; i < clusters; i++) {
+    set_fat_entry(defrag->FAT, start + i, i + 1 == clusters ? 0xfff : start + i + 1);
+  }
+  defrag->next = start + clusters;
+  *first = clusters ? start : 0;
+  return true;
+}
+
+static bool defragWrite(struct defrag_t *defrag, uint16_t cluster, uint8_t *data, uint32_t size) {
+  uint64_t offset = global_data.volume->dataOffset + (uint64_t)(cluster - 2) * defrag->clusterSize;
+  return pwrite(defrag->fd, data, size, offset) == size;
+}
+
+static bool defragDirectory(struct defrag_t *defrag, FileEntry_t *directory, uint16_t self, uint16_t parent) {
+  // lays out the directory's files right after the directory itself, then recurses into subdirectories
+  FileEntry_t *entries = (FileEntry_t *)getContents(global_data.volume, directory);
+  uint32_t capacity = directoryCapacity(global_data.volume, directory);
+  if (entries == NULL) {
+    return false;
+  }
+  if (directory == NULL) {
+    // the root directory buffer is shared, work on a copy
+    FileEntry_t *copy = malloc(capacity * sizeof(FileEntry_t));
+    if (copy == NULL) {
+      return false;
+    }
+    memcpy(copy, entries, capacity * sizeof(FileEntry_t));
+    entries = copy;
+  }
+  bool success = true;
+  for (uint32_t i = 0; success && i < capacity && !lastEntry(&entries[i]); i++) {
+    FileEntry_t *entry = &entries[i];
+    if (!liveEntry(entry) || is_directory(entry)) {
+      continue;
+    }
+    uint32_t clusters = (entry->file_size + defrag->clusterSize - 1) / defrag->clusterSize;
+    uint8_t *contents = clusters ? getContents(global_data.volume, entry) : NULL;
+    uint16_t first = 0;
+    success = (clusters == 0 || contents != NULL) && defragAllocate(defrag, clusters, &first);
+    if (success && clusters) {
+      success = defragWrite(defrag, first, contents, entry->file_size);
+    }
+    free(contents);
+    entry->first_cluster_address_low = first;
+  }
+  for (uint32_t i = 0; success && i < capacity && !lastEntry(&entries[i]); i++) {
+    FileEntry_t *entry = &entries[i];
+    if (!liveEntry(entry) || !is_directory(entry)) {
+      continue;
+    }
+    FileEntry_t original = *entry;
+    uint16_t first;
+    success = defragAllocate(defrag, countFATentries(global_data.volume, &original), &first);
+    entry->first_cluster_address_low = first;
+    success = success && defragDirectory(defrag, &original, first, self);
+  }
+  for (uint32_t i = 0; directory != NULL && i < 2 && i < capacity; i++) {
+    // . and .. point at the directory and its parent (0 for the root)
+    if (entries[i].filename[0] == '.') {
+      entries[i].first_cluster_address_low = entries[i].filename[1] == '.' ? parent : self;
+    }
+  }
+  if (success && directory == NULL) {
+    uint32_t root_in_bytes = capacity * sizeof(FileEntry_t);
+    success = pwrite(defrag->fd, entries, root_in_bytes, global_data.volume->dataOffset - root_in_bytes) == root_in_bytes;
+  } else if (success) {
+    success = defragWrite(defrag, self, (uint8_t *)entries, capacity * sizeof(FileEntry_t));
+  }
+  free(entries);
+  return success;
+}
+
+static const char *loadedFile(Volume_t *volume, const char *name) {
+  // "image" or "overlay" if name is a file the volume has open, those must never be truncated under it
+  struct stat target, source;
+  int open_files[] = {volume->image->fd, volume->image->overlayFd};
+  for (int i = 0; i < 2 && stat(name, &target) == 0; i++) {
+    if (fstat(open_files[i], &source) == 0 && target.st_dev == source.st_dev && target.st_ino == source.st_ino) {
+      return i == 0 ? "image" : "overlay";
+    }
+  }
+  return NULL;
+}
+
+static void defragment(const char *output) {
+  // writes a copy of the image where every chain is contiguous
+  BootSector_t *BS = global_data.volume->BS;
+  const char *loaded = loadedFile(global_data.volume, output);
+  if (loaded != NULL) {
+    printf("  %s is the loaded %s, write the defragmented image to another file.\n", output, loaded);
+    return;
+  }
+  uint32_t number_of_sectors = MAX(BS->number_of_sectors_2b, BS->number_of_sectors_4b);
+  uint32_t FAT_in_bytes = BS->size_of_FAT * BS->bytes_per_sector;
+  uint64_t image_size = (uint64_t)number_of_sectors * BS->bytes_per_sector;
+  uint64_t reserved_in_bytes = (uint64_t)BS->reserved_area * BS->bytes_per_sector;
+  struct defrag_t defrag = {0};
+  defrag.clusterSize = BS->bytes_per_sector * BS->sectors_per_cluster;
+  defrag.clusterLimit = 2 + (image_size - global_data.volume->dataOffset) / defrag.clusterSize;
+  if (defrag.clusterLimit > MAX_CLUSTERS) {
+    defrag.clusterLimit = MAX_CLUSTERS;
+  }
+  defrag.next = 2;
+  defrag.FAT = calloc(FAT_in_bytes, sizeof(uint8_t));
+  uint8_t *reserved = calloc(reserved_in_bytes, sizeof(uint8_t));
+  defrag.fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (defrag.FAT == NULL || reserved == NULL || defrag.fd < 0) {
+    printf("  Couldn't create %s.\n", output);
+    free(defrag.FAT);
+    free(reserved);
+    if (defrag.fd >= 0) {
+      close(defrag.fd);
+    }
+    return;
+  }
+  // the first two entries hold the media descriptor, bad clusters stay bad
+  set_fat_entry(defrag.FAT, 0, get_fat_entry(global_data.volume->FAT, 0));
+  set_fat_entry(defrag.FAT, 1, get_fat_entry(global_data.volume->FAT, 1));
+  for (uint32_t i = 2; i < defrag.clusterLimit; i++) {
+    if (bad_entry(get_fat_entry(global_data.volume->FAT, i))) {
+      set_fat_entry(defrag.FAT, i, 0xff7);
+    }
+  }
+  bool success = ftruncate(defrag.fd, image_size) == 0;
+  success = success && imageRead(global_data.volume->image, reserved, reserved_in_bytes, 0) == reserved_in_bytes;
+  success = success && pwrite(defrag.fd, reserved, reserved_in_bytes, 0) == reserved_in_bytes;
+  success = success && defragDirectory(&defrag, NULL, 0, 0);
+  for (int i = 0; success && i < BS->FATs; i++) {
+    success = pwrite(defrag.fd, defrag.FAT, FAT_in_bytes, reserved_in_bytes + (uint64_t)i * FAT_in_bytes) == FAT_in_bytes;
+  }
+  close(defrag.fd);
+  free(defrag.FAT);
+  free(reserved);
+  if (!success) {
+    printf("  Couldn't defragment the image, %s is incomplete.\n", output);
+    return;
+  }
+  printf("  Defragmented image written to %s (%u clusters in use).\n", output, defrag.next - 2);
+}
+
+static void collectExport(FileEntry_t *entry, const char *path, uint32_t depth, void *context) {
+  // notes which clusters hold directories and how much of each file cluster is past the end of the file
+  struct export_t *export = context;
+  Volume_t *volume = global_data.volume;
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t guard = volume->geometry.clusterLimit;
+  uint32_t remaining = entry->file_size;
+  uint16_t cluster = entry->first_cluster_address_low;
+  while (used_entry(cluster) && cluster < volume->geometry.clusterLimit && guard-- > 0) {
+    if (is_directory(entry)) {
+      export->directories[cluster / 8] |= 1 << (cluster % 8);
+    } else {
+      export->keep[cluster] = MIN(remaining, cluster_size);
+      remaining -= export->keep[cluster];
+    }
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+}
+
+static void scrubEntries(FileEntry_t *entries, uint32_t count) {
+  // deleted entries keep only their marker, whatever follows the end of the directory is cleared
+  bool ended = false;
+  for (uint32_t i = 0; i < count; i++) {
+    ended = ended || lastEntry(&entries[i]);
+    if (ended || entries[i].allocation_status == DELETED) {
+      memset(&entries[i], 0, sizeof(FileEntry_t));
+      entries[i].allocation_status = ended ? UNALLOCATED : DELETED;
+    }
+  }
+}
+
+static void exportImage(char **arguments, int count) {
+  // export [--sparse] [--scrub] <image> writes the volume as it's loaded, unflushed changes included.
+  // only clusters the FAT has in use are copied with either flag, the others are left as holes
+  Volume_t *volume = global_data.volume;
+  struct geometry_t *geometry = &volume->geometry;
+  struct export_t export = {0};
+  const char *output = NULL;
+  for (int i = 0; i < count; i++) {
+    if (strcmp(arguments[i], "--sparse") == 0) {
+      export.sparse = true;
+    } else if (strcmp(arguments[i], "--scrub") == 0) {
+      export.scrub = true;
+    } else if (output == NULL) {
+      output = arguments[i];
+    } else {
+      printf("  Unexpected argument '%s'.\n", arguments[i]);
+      return;
+    }
+  }
+  if (output == NULL) {
+    printf("  No output image supplied!\n");
+    return;
+  }
+  const char *loaded = loadedFile(volume, output);
+  if (loaded != NULL) {
+    printf("  %s is the loaded %s, export to another file.\n", output, loaded);
+    return;
+  }
+  uint32_t cluster_size = geometry->clusterSize;
+  uint32_t limit = geometry->clusterLimit;
+  uint64_t image_size = (uint64_t)geometry->sectorCount * geometry->bytesPerSector;
+  uint32_t chunk_size = MAX(EXPORT_CHUNK, cluster_size);
+  uint8_t *reserved = malloc(geometry->FATOffset);
+  uint8_t *root = malloc(geometry->rootSize);
+  uint8_t *chunk = malloc(chunk_size);
+  bool success = reserved != NULL && root != NULL && chunk != NULL;
+  if (success && export.scrub) {
+    export.keep = malloc(limit * sizeof(uint32_t));
+    export.directories = calloc((limit + 7) / 8, sizeof(uint8_t));
+    success = export.keep != NULL && export.directories != NULL;
+    for (uint32_t i = 0; success && i < limit; i++) {
+      export.keep[i] = cluster_size;
+    }
+    if (success) {
+      char path[PATH_SIZE] = "";
+      walkDirectory(volume, NULL, path, 0, collectExport, &export);
+    }
+  }
+  int fd = success ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+  if (fd < 0) {
+    printf("  Couldn't create %s.\n", output);
+    free(reserved);
+    free(root);
+    free(chunk);
+    free(export.keep);
+    free(export.directories);
+    return;
+  }
+  // the file starts out as one hole, everything not written below reads as zeros
+  success = ftruncate(fd, image_size) == 0;
+  success = success && imageRead(volume->image, reserved, geometry->FATOffset, 0) == geometry->FATOffset;
+  success = success && pwrite(fd, reserved, geometry->FATOffset, 0) == geometry->FATOffset;
+  for (uint32_t i = 0; success && i < geometry->FATCopies; i++) {
+    success = pwrite(fd, volume->FAT, geometry->FATSize, geometry->FATOffset + (uint64_t)i * geometry->FATSize) == geometry->FATSize;
+  }
+  memcpy(root, volume->rootEntries, geometry->rootSize);
+  if (export.scrub) {
+    scrubEntries((FileEntry_t *)root, geometry->rootSize / sizeof(FileEntry_t));
+  }
+  success = success && pwrite(fd, root, geometry->rootSize, geometry->rootOffset) == geometry->rootSize;
+  uint32_t copied = 0;
+  uint32_t cluster = 2;
+  while (success && cluster < limit) {
+    uint16_t entry = get_fat_entry(volume->FAT, cluster);
+    bool wanted = used_entry(entry) || last_entry(entry) || (!export.sparse && !export.scrub);
+    if (!wanted) {
+      cluster++;
+      continue;
+    }
+    // a run of wanted clusters is read and written in one go
+    uint32_t first = cluster;
+    while (cluster < limit && (cluster - first + 1) * cluster_size <= chunk_size) {
+      entry = get_fat_entry(volume->FAT, cluster);
+      if (!(used_entry(entry) || last_entry(entry) || (!export.sparse && !export.scrub))) {
+        break;
+      }
+      cluster++;
+    }
+    uint32_t size = (cluster - first) * cluster_size;
+    success = readExtent(volume, first, chunk, size);
+    success = success && (volume->readahead == NULL || readaheadWait(volume->readahead) == 0);
+    for (uint32_t i = first; success && export.scrub && i < cluster; i++) {
+      uint8_t *data = chunk + (uint64_t)(i - first) * cluster_size;
+      if (export.directories[i / 8] & (1 << (i % 8))) {
+        scrubEntries((FileEntry_t *)data, cluster_size / sizeof(FileEntry_t));
+      } else {
+        memset(data + export.keep[i], 0, cluster_size - export.keep[i]);
+      }
+    }
+    success = success && pwrite(fd, chunk, size, volume->dataOffset + (uint64_t)(first - 2) * cluster_size) == size;
+    copied += cluster - first;
+  }
+  close(fd);
+  free(reserved);
+  free(root);
+  free(chunk);
+  free(export.keep);
+  free(export.directories);
+  if (!success) {
+    printf("  Couldn't export the image, %s is incomplete.\n", output);
+    return;
+  }
+  printf("  Image written to %s (%u of %u clusters copied).\n", output, copied, limit - 2);
+}
+
+static uint64_t chainFingerprint(Volume_t *volume, uint16_t cluster) {
+  // changes whenever a file is moved to other clusters, only the FAT is read
+  uint64_t hash = FNV_OFFSET;
+  uint32_t guard = volume->geometry.clusterLimit;
+  while (used_entry(cluster) && guard-- > 0) {
+    hash = (hash ^ (cluster & 0xff)) * FNV_PRIME;
+    hash = (hash ^ (cluster >> 8)) * FNV_PRIME;
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+  return hash;
+}
+
+static bool addManifestEntry(struct manifest_t *manifest, const char *path, uint32_t size, uint32_t modified, uint64_t chain, uint32_t checksum) {
+  if (manifest->count == manifest->capacity) {
+    uint32_t capacity = manifest->capacity ? manifest->capacity * 2 : 256;
+    struct manifest_entry_t *entries = realloc(manifest->entries, capacity * sizeof(struct manifest_entry_t));
+    if (entries == NULL) {
+      return false;
+    }
+    manifest->entries = entries;
+    manifest->capacity = capacity;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    return false;
+  }
+  manifest->entries[manifest->count++] = (struct manifest_entry_t){copy, size, modified, chain, checksum};
+  return true;
+}
+
+static int compareManifestEntries(const void *a, const void *b) {
+  return strcmp(((const struct manifest_entry_t *)a)->path, ((const struct manifest_entry_t *)b)->path);
+}
+
+static bool loadManifest(const char *name, struct manifest_t *manifest) {
+  // a missing manifest is an empty one, lines are "path<tab>size<tab>modified<tab>chain<tab>crc32"
+  FILE *file = fopen(name, "r");
+  if (file == NULL) {
+    return true;
+  }
+  char line[PATH_SIZE + 64];
+  bool success = true;
+  bool truncated = false;
+  while (success && fgets(line, sizeof(line), file) != NULL) {
+    // a line longer than the buffer isn't a record we wrote, skip the rest of it rather than parse it as a new one
+    bool skip = truncated;
+    truncated = strchr(line, '\n') == NULL && !feof(file);
+    if (skip || truncated || line[0] == '#') {
+      continue;
+    }
+    char *fields = strchr(line, '\t');
+    if (fields == NULL || fields - line >= PATH_SIZE) {
+      continue;
+    }
+    *fields++ = '\0';
+    uint32_t size, modified, checksum;
+    unsigned long long chain;
+    if (sscanf(fields, "%u\t%u\t%llx\t%x", &size, &modified, &chain, &checksum) != 4) {
+      continue;
+    }
+    success = addManifestEntry(manifest, line, size, modified, chain, checksum);
+  }
+  fclose(file);
+  qsort(manifest->entries, manifest->count, sizeof(struct manifest_entry_t), compareManifestEntries);
+  return success;
+}
+
+static bool saveManifest(const char *name, struct manifest_t *manifest) {
+  // written next to the old one and renamed over it, so an interrupted run leaves the old manifest
+  char temporary[PATH_SIZE + 8];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", name);
+  FILE *file = fopen(temporary, "w");
+  if (file == NULL) {
+    return false;
+  }
+  fprintf(file, "%s\n", MANIFEST_HEADER);
+  for (uint32_t i = 0; i < manifest->count; i++) {
+    struct manifest_entry_t *entry = &manifest->entries[i];
+    fprintf(file, "%s\t%u\t%u\t%016llx\t%08x\n", entry->path, entry->size, entry->modified, (unsigned long long)entry->chain, entry->checksum);
+  }
+  bool success = fflush(file) == 0 && fsync(fileno(file)) == 0;
+  success = fclose(file) == 0 && success;
+  return success && rename(temporary, name) == 0;
+}
+
+static void freeManifest(struct manifest_t *manifest) {
+  for (uint32_t i = 0; i < manifest->count; i++) {
+    free(manifest->entries[i].path);
+  }
+  free(manifest->entries);
+  memset(manifest, 0, sizeof(*manifest));
+}
+
+static bool extractFile(Volume_t *volume, uint32_t row, const char *destination, uint32_t *checksum) {
+  // writes the file of a row to the host with its modification time, checksumming it on the way
+  struct entry_table_t *table = &volume->table;
+  FileEntry_t entry = {0};
+  entry.first_cluster_address_low = table->firstCluster[row];
+  entry.file_size = table->size[row];
+  entry.file_attributes = table->attributes[row];
+  uint8_t *contents = entry.file_size > 0 ? getContents(volume, &entry) : NULL;
+  if (entry.file_size > 0 && contents == NULL) {
+    return false;
+  }
+  int fd = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool success = fd >= 0;
+  for (uint32_t done = 0; success && done < entry.file_size;) {
+    ssize_t written = write(fd, contents + done, entry.file_size - done);
+    success = written > 0;
+    done += success ? written : 0;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  *checksum = crc32(0, contents, entry.file_size);
+  free(contents);
+  if (success && table->modified[row] != 0) {
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = (time_t)table->modified[row] + UNIX_1980}};
+    utimensat(AT_FDCWD, destination, times, 0);
+  }
+  return success;
+}
+
+static void extractTree(char **arguments, int count) {
+  // get -r <path> <directory> [manifest] copies a directory of the image to the host. with a manifest, files
+  // whose size, modification time and cluster chain haven't changed since the last run (and are still on
+  // the host) aren't read at all, the manifest is then rewritten to describe this run
+  if (count < 2) {
+    printf("  Usage: get -r <path> <directory> [manifest]\n");
+    return;
+  }
+  Volume_t *volume = global_data.volume;
+  struct entry_table_t *table = &volume->table;
+  char path[PATH_SIZE];
+  if (arguments[0][0] == '/') {
+    snprintf(path, sizeof(path), "%s", arguments[0]);
+  } else {
+    formatCurrentDirectory(path, sizeof(path));
+    if (strcmp(arguments[0], ".") != 0) {
+      snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", arguments[0]);
+    }
+  }
+  int32_t root = tableLookup(table, path);
+  if (root == -2 || (root >= 0 && !(table->attributes[root] & DIRECTORY))) {
+    printf("  %s isn't a directory.\n", arguments[0]);
+    return;
+  }
+  // rows of a directory's subtree are the ones right after it
+  uint32_t first = root < 0 ? 0 : root + 1;
+  uint32_t last = root < 0 ? table->count : table->subtreeEnd[root];
+  size_t prefix = root < 0 ? 0 : tablePath(table, root, path, sizeof(path));
+  const char *directory = arguments[1];
+  const char *manifest_name = count > 2 ? arguments[2] : NULL;
+  struct manifest_t previous = {0}, current = {0};
+  if (manifest_name != NULL && !loadManifest(manifest_name, &previous)) {
+    printf("  Couldn't read %s.\n", manifest_name);
+    freeManifest(&previous);
+    return;
+  }
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    printf("  Couldn't create %s.\n", directory);
+    freeManifest(&previous);
+    return;
+  }
+  uint32_t extracted = 0, unchanged = 0, failed = 0, directories = 0;
+  uint64_t bytes = 0;
+  char host[PATH_SIZE * 2];
+  for (uint32_t row = first; row < last; row++) {
+    tablePath(table, row, path, sizeof(path));
+    const char *relative = path + prefix + 1;
+    snprintf(host, sizeof(host), "%s/%s", directory, relative);
+    if (table->attributes[row] & DIRECTORY) {
+      // parents come before their children, so one mkdir() per directory is enough
+      if (mkdir(host, 0755) != 0 && errno != EEXIST) {
+        printf("  Couldn't create %s.\n", host);
+        failed += table->subtreeEnd[row] - row;
+        row = table->subtreeEnd[row] - 1;
+        continue;
+      }
+      directories++;
+      continue;
+    }
+    uint64_t chain = chainFingerprint(volume, table->firstCluster[row]);
+    struct manifest_entry_t key = {.path = (char *)relative};
+    struct manifest_entry_t *known = bsearch(&key, previous.entries, previous.count, sizeof(key), compareManifestEntries);
+    struct stat info;
+    uint32_t checksum;
+    if (known != NULL && known->size == table->size[row] && known->modified == table->modified[row] && known->chain == chain &&
+        stat(host, &info) == 0 && (uint64_t)info.st_size == table->size[row]) {
+      checksum = known->checksum;
+      unchanged++;
+    } else if (extractFile(volume, row, host, &checksum)) {
+      extracted++;
+      bytes += table->size[row];
+    } else {
+      printf("  Couldn't extract %s.\n", path);
+      failed++;
+      continue;
+    }
+    if (manifest_name != NULL && !addManifestEntry(&current, relative, table->size[row], table->modified[row], chain, checksum)) {
+      printf("  Couldn't allocate memory, the manifest won't be written.\n");
+      manifest_name = NULL;
+    }
+  }
+  printf("  %u files extracted (%llu bytes), %u unchanged, %u directories", extracted, (unsigned long long)bytes, unchanged, directories);
+  printf(failed > 0 ? ", %u failed.\n" : ".\n", failed);
+  if (manifest_name != NULL && !saveManifest(manifest_name, &current)) {
+    printf("  Couldn't write %s.\n", manifest_name);
+  }
+  freeManifest(&previous);
+  freeManifest(&current);
+}
+
+static bool writableVolume(void) {
+  // changes are made to the loaded copy and written back with flush, lazily loaded volumes keep
+  // copies of just the clusters they change
+  Volume_t *volume = global_data.volume;
+  if (volume->image->format != image_raw) {
+    printf("  Compressed images can't be modified.\n");
+    return false;
+  }
+  return true;
+}
+
+static void markDirty(Volume_t *volume, uint64_t offset, uint64_t size) {
+  uint32_t sector_count = volume->geometry.sectorCount;
+  if (volume->dirty == NULL) {
+    volume->dirty = calloc((sector_count + 7) / 8, sizeof(uint8_t));
+    if (volume->dirty == NULL) {
+      printf("  Couldn't allocate memory, changes won't be flushed!\n");
+      return;
+    }
+  }
+  uint32_t bytes_per_sector = volume->geometry.bytesPerSector;
+  uint32_t last = MIN((offset + size + bytes_per_sector - 1) / bytes_per_sector, sector_count);
+  for (uint32_t sector = offset / bytes_per_sector; sector < last; sector++) {
+    uint8_t bit = 1 << (sector % 8);
+    volume->dirtySectors += !(volume->dirty[sector / 8] & bit);
+    volume->dirty[sector / 8] |= bit;
+  }
+}
+
+static uint8_t *clusterData(Volume_t *volume, uint16_t cluster, bool load) {
+  // the cluster's bytes to change in place, NULL if it can't be had. when the data area isn't loaded
+  // it's a copy kept until the next flush, read from the image first unless load is false because
+  // all of it is about to be overwritten
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  if (cluster < 2 || cluster >= volume->geometry.clusterLimit) {
+    return NULL;
+  }
+  if (volume->dataSection != NULL) {
+    return (uint8_t *)volume->dataSection + (uint64_t)(cluster - 2) * cluster_size;
+  }
+  if (volume->changed == NULL) {
+    volume->changed = calloc(volume->geometry.clusterLimit, sizeof(uint8_t *));
+    if (volume->changed == NULL) {
+      return NULL;
+    }
+  }
+  if (volume->changed[cluster] == NULL) {
+    uint8_t *copy = calloc(1, cluster_size);
+    uint64_t offset = volume->dataOffset + (uint64_t)(cluster - 2) * cluster_size;
+    if (copy != NULL && load) {
+      pthread_mutex_lock(&volume->lock);
+      if (imageRead(volume->image, copy, cluster_size, offset) != cluster_size) {
+        free(copy);
+        copy = NULL;
+      }
+      pthread_mutex_unlock(&volume->lock);
+    }
+    volume->changed[cluster] = copy;
+  }
+  return volume->changed[cluster];
+}
+
+static void releaseChanged(Volume_t *volume) {
+  // once flushed the image holds the same bytes as the copies
+  if (volume->changed == NULL) {
+    return;
+  }
+  for (uint32_t cluster = 0; cluster < volume->geometry.clusterLimit; cluster++) {
+    free(volume->changed[cluster]);
+  }
+  free(volume->changed);
+  volume->changed = NULL;
+}
+
+static uint8_t *sectorSource(Volume_t *volume, uint32_t sector) {
+  // where the current contents of a sector are kept, every FAT copy is written from the main FAT
+  struct geometry_t *geometry = &volume->geometry;
+  uint64_t offset = (uint64_t)sector * geometry->bytesPerSector;
+  if (offset >= volume->dataOffset) {
+    uint64_t data_size = (uint64_t)geometry->sectorCount * geometry->bytesPerSector - volume->dataOffset;
+    if (offset - volume->dataOffset >= data_size) {
+      return NULL;
+    }
+    if (volume->dataSection != NULL) {
+      return (uint8_t *)volume->dataSection + (offset - volume->dataOffset);
+    }
+    uint64_t cluster = 2 + (offset - volume->dataOffset) / geometry->clusterSize;
+    if (volume->changed == NULL || cluster >= geometry->clusterLimit || volume->changed[cluster] == NULL) {
+      return NULL;
+    }
+    return volume->changed[cluster] + (offset - volume->dataOffset) % geometry->clusterSize;
+  }
+  if (offset >= geometry->rootOffset) {
+    return offset - geometry->rootOffset < geometry->rootSize ? (uint8_t *)volume->rootEntries + (offset - geometry->rootOffset) : NULL;
+  }
+  if (offset >= geometry->FATOffset) {
+    return volume->FAT + (offset - geometry->FATOffset) % geometry->FATSize;
+  }
+  return NULL;
+}
+
+static bool flushVolume(Volume_t *volume, uint32_t *writes) {
+  // writes the dirty sectors back, every run of them with one pwritev() gathering from the FAT,
+  // root directory and data buffers, the rest of the image isn't touched. with an overlay they go
+  // to the overlay and the image isn't opened for writing at all
+  struct geometry_t *geometry = &volume->geometry;
+  uint32_t bytes_per_sector = geometry->bytesPerSector;
+  Image_t *image = volume->image;
+  bool overlay = image->overlayFd >= 0;
+  *writes = 0;
+  if (volume->dirtySectors == 0) {
+    releaseChanged(volume);
+    return true;
+  }
+  int fd = overlay ? -1 : open(volume->filename, O_WRONLY);
+  if (fd < 0 && !overlay) {
+    return false;
+  }
+  struct iovec vectors[FLUSH_VECTORS];
+  bool success = true;
+  uint32_t sector = 0;
+  while (success && sector < geometry->sectorCount) {
+    if (volume->dirty[sector / 8] == 0) {
+      sector = (sector / 8 + 1) * 8;
+      continue;
+    }
+    if (!(volume->dirty[sector / 8] & (1 << (sector % 8)))) {
+      sector++;
+      continue;
+    }
+    uint64_t offset = (uint64_t)sector * bytes_per_sector;
+    size_t total = 0;
+    int count = 0;
+    while (sector < geometry->sectorCount && (volume->dirty[sector / 8] & (1 << (sector % 8)))) {
+      uint8_t *source = sectorSource(volume, sector);
+      if (source == NULL) {
+        success = false;
+        break;
+      }
+      struct iovec *last = count > 0 ? &vectors[count - 1] : NULL;
+      if (last != NULL && (uint8_t *)last->iov_base + last->iov_len == source) {
+        last->iov_len += bytes_per_sector;
+      } else if (count < FLUSH_VECTORS) {
+        vectors[count++] = (struct iovec){source, bytes_per_sector};
+      } else {
+        // the rest of the run goes into the next write
+        break;
+      }
+      total += bytes_per_sector;
+      sector++;
+    }
+    if (overlay) {
+      success = success && imageOverlayWrite(image, vectors, count, offset);
+    } else {
+      success = success && pwritev(fd, vectors, count, offset) == total;
+    }
+    (*writes)++;
+  }
+  if (overlay) {
+    success = success && imageOverlaySync(image);
+  } else {
+    success = success && fdatasync(fd) == 0;
+    close(fd);
+  }
+  if (success) {
+    memset(volume->dirty, 0, (geometry->sectorCount + 7) / 8);
+    volume->dirtySectors = 0;
+    releaseChanged(volume);
+  }
+  return success;
+}
+
+static void setFATEntry(Volume_t *volume, uint16_t cluster, uint16_t value) {
+  // changes the main FAT, every copy gets written from it
+  struct geometry_t *geometry = &volume->geometry;
+  set_fat_entry(volume->FAT, cluster, value);
+  for (uint32_t i = 0; i < geometry->FATCopies; i++) {
+    markDirty(volume, geometry->FATOffset + (uint64_t)i * geometry->FATSize + cluster + cluster / 2, 2);
+  }
+}
+
+static uint32_t countFreeClusters(Volume_t *volume) {
+  uint32_t count = 0;
+  for (uint32_t i = 2; i < volume->geometry.clusterLimit; i++) {
+    count += free_entry(get_fat_entry(volume->FAT, i));
+  }
+  return count;
+}
+
+static bool allocateClusters(Volume_t *volume, uint32_t count, uint16_t hint, uint16_t *clusters) {
+  // picks free clusters for a chain, one run if there's one long enough (preferably starting at hint,
+  // so that a growing chain stays contiguous), otherwise the longest runs so there are few fragments
+  uint32_t limit = volume->geometry.clusterLimit;
+  uint16_t *runs = malloc(limit * sizeof(uint16_t)); // start and length of every free run
+  if (runs == NULL) {
+    return false;
+  }
+  uint32_t run_count = 0;
+  uint32_t free_clusters = 0;
+  int32_t chosen = -1;
+  for (uint32_t i = 2; i < limit; i++) {
+    if (!free_entry(get_fat_entry(volume->FAT, i))) {
+      continue;
+    }
+    uint32_t start = i;
+    while (i < limit && free_entry(get_fat_entry(volume->FAT, i))) {
+      i++;
+    }
+    runs[run_count * 2] = start;
+    runs[run_count * 2 + 1] = i - start;
+    free_clusters += i - start;
+    if (start <= hint && hint < i && i - hint >= count) {
+      // the run continues the chain
+      runs[run_count * 2 + 1] = i - hint;
+      runs[run_count * 2] = hint;
+      chosen = run_count;
+    } else if (chosen < 0 && i - start >= count) {
+      chosen = run_count;
+    }
+    run_count++;
+  }
+  if (free_clusters < count) {
+    free(runs);
+    return false;
+  }
+  uint32_t taken = 0;
+  if (chosen >= 0) {
+    for (; taken < count; taken++) {
+      clusters[taken] = runs[chosen * 2] + taken;
+    }
+  }
+  while (taken < count) {
+    uint32_t longest = 0;
+    for (uint32_t i = 1; i < run_count; i++) {
+      longest = runs[i * 2 + 1] > runs[longest * 2 + 1] ? i : longest;
+    }
+    for (uint32_t j = 0; j < runs[longest * 2 + 1] && taken < count; j++) {
+      clusters[taken++] = runs[longest * 2] + j;
+    }
+    runs[longest * 2 + 1] = 0;
+  }
+  free(runs);
+  return true;
+}
+
+static void linkChain(Volume_t *volume, uint16_t previous, const uint16_t *clusters, uint32_t count) {
+  // chains the clusters one after another, after previous if it isn't 0
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0 || previous != 0) {
+      setFATEntry(volume, i > 0 ? clusters[i - 1] : previous, clusters[i]);
+    }
+  }
+  if (count > 0) {
+    setFATEntry(volume, clusters[count - 1], 0xfff);
+  }
+}
+
+static void freeChain(Volume_t *volume, uint16_t cluster) {
+  uint32_t guard = volume->geometry.clusterLimit;
+  while (used_entry(cluster) && cluster < volume->geometry.clusterLimit && guard-- > 0) {
+    uint16_t next = get_fat_entry(volume->FAT, cluster);
+    setFATEntry(volume, cluster, 0);
+    cluster = next;
+  }
+}
+
+static void writeClusters(Volume_t *volume, const uint16_t *clusters, uint32_t count, const uint8_t *data, uint32_t size) {
+  // fills the clusters with data, whatever is left past size is zeroed
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t offset = (uint64_t)(clusters[i] - 2) * cluster_size;
+    uint8_t *destination = clusterData(volume, clusters[i], false);
+    if (destination == NULL) {
+      printf("  Couldn't allocate memory, changes won't be flushed!\n");
+      return;
+    }
+    uint32_t written = 0;
+    if (data != NULL && (uint64_t)i * cluster_size < size) {
+      written = MIN(cluster_size, size - i * cluster_size);
+      memcpy(destination, data + (uint64_t)i * cluster_size, written);
+    }
+    memset(destination + written, 0, cluster_size - written);
+    markDirty(volume, volume->dataOffset + offset, cluster_size);
+  }
+}
+
+static bool makeShortName(const char *name, uint8_t *short_name) {
+  // NAME.EXT padded with spaces the way it's stored in an entry, false if it isn't a valid 8.3 name
+  const char *dot = strrchr(name, '.');
+  size_t base = dot ? dot - name : strlen(name);
+  size_t extension = dot ? strlen(dot + 1) : 0;
+  if (base == 0 || base > 8 || extension > 3 || (dot && extension == 0)) {
+    return false;
+  }
+  memset(short_name, ' ', 11);
+  for (size_t i = 0; name[i]; i++) {
+    unsigned char c = name[i];
+    if (name + i == dot) {
+      continue;
+    }
+    if (c <= ' ' || strchr("\"*+,./:;<=>?[\\]|", c) != NULL) {
+      return false;
+    }
+    short_name[dot == NULL || name + i < dot ? i : 8 + (name + i - dot - 1)] = toupper(c);
+  }
+  return true;
+}
+
+static void stampEntry(FileEntry_t *entry, time_t when, bool created) {
+  // sets the modification time (and the creation time too for new entries), dates before 1980 can't be stored
+  struct tm local;
+  localtime_r(&when, &local);
+  if (local.tm_year < 80) {
+    local = (struct tm){.tm_year = 80, .tm_mday = 1};
+  }
+  entry->modified_date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+  entry->modified_time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+  entry->access_date = entry->modified_date;
+  if (created) {
+    entry->creation_date = entry->modified_date;
+    entry->creation_time = entry->modified_time;
+  }
+}
+
+static bool resolveParent(char *path, FileEntry_t **parent, char **name) {
+  // splits a path into the directory it's in (NULL for the root) and the last component
+  char *slash = strrchr(path, '/');
+  if (slash == NULL) {
+    *parent = getCurrentDir();
+    *name = path;
+    return true;
+  }
+  *name = slash + 1;
+  if (slash == path) {
+    *parent = NULL;
+    return true;
+  }
+  *slash = 0;
+  File_t *handle = goAndFetch(path, true);
+  *slash = '/';
+  if (handle == NULL) {
+    return false;
+  }
+  if (handle == ROOT) {
+    *parent = NULL;
+    return true;
+  }
+  *parent = handle->_entry;
+  fileClose(handle);
+  return is_directory(*parent);
+}
+
+static FileEntry_t *findSlot(Volume_t *volume, FileEntry_t *directory, const uint8_t *short_name, uint64_t *offset) {
+  // the entry called short_name in the loaded directory itself (not a copy) or with short_name NULL
+  // the first free one, offset is where the entry is in the image
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t per_cluster = directory == NULL ? volume->BS->max_files_in_root : cluster_size / sizeof(FileEntry_t);
+  uint16_t cluster = directory == NULL ? 0 : directory->first_cluster_address_low;
+  uint32_t guard = volume->geometry.clusterLimit;
+  while ((directory == NULL || used_entry(cluster)) && guard-- > 0) {
+    FileEntry_t *entries = volume->rootEntries;
+    uint64_t base = volume->geometry.rootOffset;
+    if (directory != NULL) {
+      entries = (FileEntry_t *)clusterData(volume, cluster, true);
+      if (entries == NULL) {
+        return NULL;
+      }
+      base = volume->dataOffset + (uint64_t)(cluster - 2) * cluster_size;
+    }
+    for (uint32_t i = 0; i < per_cluster; i++) {
+      FileEntry_t *entry = &entries[i];
+      bool vacant = entry->allocation_status == DELETED || entry->allocation_status == UNALLOCATED;
+      bool named = !vacant && (entry->file_attributes & LONG_FILENAME) != LONG_FILENAME && !(entry->file_attributes & VOLUME_LABEL);
+      if (short_name == NULL ? vacant : named && memcmp(entry->filename, short_name, 11) == 0) {
+        *offset = base + i * sizeof(FileEntry_t);
+        return entry;
+      }
+      if (short_name != NULL && entry->allocation_status == UNALLOCATED) {
+        // nothing is stored past the end marker
+        return NULL;
+      }
+    }
+    if (directory == NULL) {
+      break;
+    }
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+  return NULL;
+}
+
+static FileEntry_t *newSlot(Volume_t *volume, FileEntry_t *directory, uint64_t *offset) {
+  // a free entry in the directory, a full subdirectory grows by one cluster
+  FileEntry_t *slot = findSlot(volume, directory, NULL, offset);
+  if (slot != NULL || directory == NULL) {
+    return slot;
+  }
+  uint16_t last = directory->first_cluster_address_low;
+  while (used_entry(get_fat_entry(volume->FAT, last))) {
+    last = get_fat_entry(volume->FAT, last);
+  }
+  uint16_t cluster;
+  if (!allocateClusters(volume, 1, last + 1, &cluster)) {
+    return NULL;
+  }
+  linkChain(volume, last, &cluster, 1);
+  writeClusters(volume, &cluster, 1, NULL, 0);
+  return findSlot(volume, directory, NULL, offset);
+}
+
+static void putFile(const char *source, char *target) {
+  // copies a host file into the image, an existing file with the same name is replaced
+  Volume_t *volume = global_data.volume;
+  FileEntry_t *parent;
+  char *name;
+  uint8_t short_name[11];
+  if (!resolveParent(target, &parent, &name)) {
+    printf("  %s not found.\n", target);
+    return;
+  }
+  if (!makeShortName(name, short_name)) {
+    printf("  %s isn't a valid 8.3 name.\n", name);
+    return;
+  }
+  FILE *input = fopen(source, "rb");
+  if (input == NULL) {
+    printf("  Couldn't open %s.\n", source);
+    return;
+  }
+  fseek(input, 0, SEEK_END);
+  long size = ftell(input);
+  fseek(input, 0, SEEK_SET);
+  uint8_t *data = malloc(size > 0 ? size : 1);
+  bool loaded = data != NULL && size >= 0 && fread(data, 1, size, input) == (size_t)size;
+  fclose(input);
+  if (!loaded) {
+    free(data);
+    printf("  Couldn't read %s.\n", source);
+    return;
+  }
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t count = (size + cluster_size - 1) / cluster_size;
+  uint64_t offset;
+  FileEntry_t *entry = findSlot(volume, parent, short_name, &offset);
+  if (entry != NULL && is_directory(entry)) {
+    free(data);
+    printf("  %s is a directory.\n", target);
+    return;
+  }
+  // an empty file has no chain, countFATentries would count its cluster 0 as one
+  uint32_t reusable = entry != NULL && entry->first_cluster_address_low != 0 ? countFATentries(volume, entry) : 0;
+  uint16_t *clusters = malloc((count + 1) * sizeof(uint16_t));
+  if (clusters == NULL || countFreeClusters(volume) + reusable < count + (entry == NULL)) {
+    // one cluster more for a new entry in case the directory is full
+    free(data);
+    free(clusters);
+    printf("  Not enough free space for %s.\n", target);
+    return;
+  }
+  if (entry != NULL) {
+    freeChain(volume, entry->first_cluster_address_low);
+  } else {
+    entry = newSlot(volume, parent, &offset);
+  }
+  if (entry == NULL || !allocateClusters(volume, count, 2, clusters)) {
+    free(data);
+    free(clusters);
+    printf("  The directory is full.\n");
+    return;
+  }
+  linkChain(volume, 0, clusters, count);
+  writeClusters(volume, clusters, count, data, size);
+  memset(entry, 0, sizeof(FileEntry_t));
+  memcpy(entry->filename, short_name, 11);
+  entry->file_attributes = ARCHIVE;
+  stampEntry(entry, time(NULL), true);
+  entry->first_cluster_address_low = count ? clusters[0] : 0;
+  entry->file_size = size;
+  markDirty(volume, offset, sizeof(FileEntry_t));
+  printf("  %s written (%u clusters).\n", target, count);
+  free(data);
+  free(clusters);
+}
+
+static void deleteLongName(Volume_t *volume, FileEntry_t *directory, FileEntry_t *entry) {
+  // marks the long name entries in front of entry deleted, they can start in the previous cluster
+  // so the directory is walked in order, remembering the last few entries and where they are
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t per_cluster = directory == NULL ? volume->BS->max_files_in_root : cluster_size / sizeof(FileEntry_t);
+  uint16_t cluster = directory == NULL ? 0 : directory->first_cluster_address_low;
+  uint32_t guard = volume->geometry.clusterLimit;
+  FileEntry_t *previous[LONG_NAME_ENTRIES];
+  uint64_t offsets[LONG_NAME_ENTRIES];
+  uint32_t seen = 0;
+  while ((directory == NULL || (used_entry(cluster) && cluster < volume->geometry.clusterLimit)) && guard-- > 0) {
+    FileEntry_t *entries = volume->rootEntries;
+    uint64_t base = volume->geometry.rootOffset;
+    if (directory != NULL) {
+      entries = (FileEntry_t *)clusterData(volume, cluster, true);
+      if (entries == NULL) {
+        return;
+      }
+      base = volume->dataOffset + (uint64_t)(cluster - 2) * cluster_size;
+    }
+    for (uint32_t i = 0; i < per_cluster; i++) {
+      if (&entries[i] != entry) {
+        previous[seen % LONG_NAME_ENTRIES] = &entries[i];
+        offsets[seen % LONG_NAME_ENTRIES] = base + i * sizeof(FileEntry_t);
+        seen++;
+        continue;
+      }
+      for (uint32_t back = 1; back <= MIN(seen, LONG_NAME_ENTRIES); back++) {
+        uint32_t slot = (seen - back) % LONG_NAME_ENTRIES;
+        FileEntry_t *part = previous[slot];
+        if ((part->file_attributes & LONG_FILENAME) != LONG_FILENAME || part->allocation_status == DELETED || part->allocation_status == UNALLOCATED) {
+          break;
+        }
+        part->allocation_status = DELETED;
+        markDirty(volume, offsets[slot], sizeof(FileEntry_t));
+      }
+      return;
+    }
+    if (directory == NULL) {
+      break;
+    }
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+}
+
+static void removeEntry(char *path) {
+  // deletes a file or an empty directory
+  Volume_t *volume = global_data.volume;
+  FileEntry_t *parent;
+  char *name;
+  uint8_t short_name[11];
+  uint64_t offset;
+  FileEntry_t *entry = NULL;
+  if (resolveParent(path, &parent, &name) && makeShortName(name, short_name)) {
+    entry = findSlot(volume, parent, short_name, &offset);
+  }
+  if (entry == NULL) {
+    printf("  %s not found.\n", path);
+    return;
+  }
+  if (is_directory(entry)) {
+    for (uint32_t i = 1; i <= global_data.historyIndex; i++) {
+      if (getDirectory(i)->first_cluster_address_low == entry->first_cluster_address_low) {
+        printf("  %s is the current directory or contains it.\n", path);
+        return;
+      }
+    }
+    FileEntry_t *entries = (FileEntry_t *)getContents(volume, entry);
+    uint32_t capacity = entries ? directoryCapacity(volume, entry) : 0;
+    bool empty = entries != NULL;
+    for (uint32_t i = 0; empty && i < capacity && !lastEntry(&entries[i]); i++) {
+      empty = !liveEntry(&entries[i]);
+    }
+    free(entries);
+    if (!empty) {
+      printf("  %s isn't empty.\n", path);
+      return;
+    }
+  }
+  freeChain(volume, entry->first_cluster_address_low);
+  deleteLongName(volume, parent, entry);
+  entry->allocation_status = DELETED;
+  markDirty(volume, offset, sizeof(FileEntry_t));
+}
+
+static void makeDirectory(char *path) {
+  Volume_t *volume = global_data.volume;
+  FileEntry_t *parent;
+  char *name;
+  uint8_t short_name[11];
+  uint64_t offset;
+  if (!resolveParent(path, &parent, &name)) {
+    printf("  %s not found.\n", path);
+    return;
+  }
+  if (!makeShortName(name, short_name)) {
+    printf("  %s isn't a valid 8.3 name.\n", name);
+    return;
+  }
+  if (findSlot(volume, parent, short_name, &offset) != NULL) {
+    printf("  %s already exists.\n", path);
+    return;
+  }
+  if (countFreeClusters(volume) < 2) {
+    printf("  Not enough free space for %s.\n", path);
+    return;
+  }
+  FileEntry_t *entry = newSlot(volume, parent, &offset);
+  uint16_t cluster;
+  if (entry == NULL || !allocateClusters(volume, 1, 2, &cluster)) {
+    printf("  The directory is full.\n");
+    return;
+  }
+  linkChain(volume, 0, &cluster, 1);
+  writeClusters(volume, &cluster, 1, NULL, 0);
+  memset(entry, 0, sizeof(FileEntry_t));
+  memcpy(entry->filename, short_name, 11);
+  entry->file_attributes = DIRECTORY;
+  stampEntry(entry, time(NULL), true);
+  entry->first_cluster_address_low = cluster;
+  markDirty(volume, offset, sizeof(FileEntry_t));
+  // . and .. point at the directory and its parent (0 for the root)
+  FileEntry_t *dots = (FileEntry_t *)clusterData(volume, cluster, false);
+  if (dots == NULL) {
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    dots[i] = *entry;
+    memset(dots[i].filename, ' ', 11);
+    memset(dots[i].filename, '.', i + 1);
+  }
+  dots[1].first_cluster_address_low = parent ? parent->first_cluster_address_low : 0;
+}
+
+static void truncateFile(char *path, uint32_t size) {
+  // shrinks or grows a file, new space reads as zeros and is placed right after the chain if possible
+  Volume_t *volume = global_data.volume;
+  FileEntry_t *parent;
+  char *name;
+  uint8_t short_name[11];
+  uint64_t offset;
+  FileEntry_t *entry = NULL;
+  if (resolveParent(path, &parent, &name) && makeShortName(name, short_name)) {
+    entry = findSlot(volume, parent, short_name, &offset);
+  }
+  if (entry == NULL || is_directory(entry)) {
+    printf("  %s not found or not a file.\n", path);
+    return;
+  }
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t wanted = (size + (uint64_t)cluster_size - 1) / cluster_size;
+  uint32_t current = entry->first_cluster_address_low == 0 ? 0 : countFATentries(volume, entry);
+  uint16_t last = 0;
+  uint16_t cluster = entry->first_cluster_address_low;
+  for (uint32_t i = 1; i < MIN(wanted, current); i++) {
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+  if (MIN(wanted, current) > 0) {
+    last = cluster;
+  }
+  if (wanted < current) {
+    freeChain(volume, last ? get_fat_entry(volume->FAT, last) : entry->first_cluster_address_low);
+    if (last) {
+      setFATEntry(volume, last, 0xfff);
+    } else {
+      entry->first_cluster_address_low = 0;
+    }
+  } else if (wanted > current) {
+    uint16_t *clusters = malloc((wanted - current) * sizeof(uint16_t));
+    if (clusters == NULL || !allocateClusters(volume, wanted - current, last + 1, clusters)) {
+      free(clusters);
+      printf("  Not enough free space to grow %s.\n", path);
+      return;
+    }
+    linkChain(volume, last, clusters, wanted - current);
+    writeClusters(volume, clusters, wanted - current, NULL, 0);
+    if (last == 0) {
+      entry->first_cluster_address_low = clusters[0];
+    }
+    free(clusters);
+  }
+  if (size > entry->file_size && last != 0 && entry->file_size % cluster_size != 0) {
+    // the old last cluster has whatever was there before past the end of the file
+    uint32_t tail = entry->file_size % cluster_size;
+    uint64_t position = (uint64_t)(last - 2) * cluster_size + tail;
+    uint8_t *data = clusterData(volume, last, true);
+    if (data != NULL) {
+      memset(data + tail, 0, cluster_size - tail);
+    }
+    markDirty(volume, volume->dataOffset + position, cluster_size - tail);
+  }
+  entry->file_size = size;
+  stampEntry(entry, time(NULL), false);
+  markDirty(volume, offset, sizeof(FileEntry_t));
+}
+
+static void refreshEntryTable(Volume_t *volume) {
+  // find and the socket server work from the entry table, it's rebuilt after every change
+  freeEntryTable(&volume->table);
+  if (!buildEntryTable(volume)) {
+    printf("  Couldn't rebuild the entry table.\n");
+  }
+}
+
+static const char *changesTarget(Volume_t *volume) {
+  return volume->image->overlayFd >= 0 ? global_data.options.overlay : volume->filename;
+}
+
+static void overlayCommand(char *action, char *argument) {
+  // overlay [commit <image> | discard], without arguments tells how much the overlay holds
+  Volume_t *volume = global_data.volume;
+  Image_t *image = volume->image;
+  if (image->overlayFd < 0) {
+    printf("  There's no overlay, start with --overlay <file> to keep changes out of the image.\n");
+    return;
+  }
+  if (action == NULL) {
+    printf("  %s holds %u of %u blocks (%u bytes each)", global_data.options.overlay, image->overlayUsed, image->overlayBlocks, OVERLAY_BLOCK_SIZE);
+    printf(", %u changed sectors aren't flushed yet.\n", volume->dirtySectors);
+    return;
+  }
+  if (strcmp(action, "commit") == 0) {
+    if (argument == NULL) {
+      printf("  No output image supplied!\n");
+      return;
+    }
+    // whatever hasn't been flushed goes to the overlay first, so the new image has every change
+    uint32_t writes;
+    if (!flushVolume(volume, &writes)) {
+      printf("  Couldn't write the changes to %s.\n", global_data.options.overlay);
+      return;
+    }
+    if (imageOverlayCommit(image, argument) != 0) {
+      printf("  Couldn't write %s.\n", argument);
+      return;
+    }
+    printf("  %s written with the %u blocks of the overlay.\n", argument, image->overlayUsed);
+    return;
+  }
+  if (strcmp(action, "discard") == 0) {
+    uint32_t dropped = volume->dirtySectors;
+    if (!imageOverlayDiscard(image)) {
+      printf("  Couldn't empty %s.\n", global_data.options.overlay);
+      return;
+    }
+    // the loaded copy still has the changes, it's read again from the image
+    Volume_t *fresh = volumeOpen(global_data.diskFilename, global_data.options);
+    if (fresh == NULL) {
+      printf("  Couldn't reload %s.\n", global_data.diskFilename);
+      return;
+    }
+    volumeClose(volume);
+    global_data.volume = fresh;
+    global_data.historyIndex = 0;
+    printf("  Overlay emptied, %u changed sectors that weren't flushed were dropped too.\n", dropped);
+    return;
+  }
+  printf("  Unknown overlay action %s, use commit or discard.\n", action);
+}
+
+int makeImage(const char *directory, const char *output) {
+  // builds the smallest FAT12 image a host directory fits in, every file and directory gets
+  // a contiguous chain in the order they are listed, so the image is written front to back
+  struct mkimage_t image = {0};
+  struct stat info;
+  if (stat(directory, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    printf("%s isn't a directory\n", directory);
+    return 1;
+  }
+  image.capacity = 256;
+  image.nodes = calloc(image.capacity, sizeof(struct mkimage_node_t));
+  if (image.nodes == NULL) {
+    printf("Couldn't allocate memory\n");
+    return 1;
+  }
+  image.nodes[0] = (struct mkimage_node_t){.hostPath = strdup(directory), .directory = true, .parent = -1, .modified = info.st_mtime};
+  image.count = 1;
+  BootSector_t BS = {0};
+  uint8_t *header = NULL;
+  int fd = -1;
+  bool success = image.nodes[0].hostPath != NULL && mkimageScan(&image, 0, 0) && mkimagePlan(&image, &BS);
+  uint32_t bytes_per_sector = BS.bytes_per_sector;
+  uint32_t FAT_in_bytes = BS.size_of_FAT * bytes_per_sector;
+  uint32_t root_offset = (BS.reserved_area + BS.FATs * BS.size_of_FAT) * bytes_per_sector;
+  uint32_t data_offset = root_offset + BS.max_files_in_root * sizeof(FileEntry_t);
+  if (success) {
+    // boot sector, FATs and the root directory are put together in memory and written at once
+    header = calloc(data_offset, sizeof(uint8_t));
+    success = header != NULL;
+  }
+  for (uint32_t i = 1; success && i < image.count; i++) {
+    struct mkimage_node_t *node = &image.nodes[i];
+    if (node->directory) {
+      node->entries = calloc(node->clusters, image.clusterSize);
+      success = node->entries != NULL;
+      if (success) {
+        mkimageDirectory(&image, i, node->entries);
+      }
+    }
+  }
+  if (success) {
+    memcpy(header, &BS, sizeof(BootSector_t));
+    uint8_t *FAT = header + BS.reserved_area * bytes_per_sector;
+    set_fat_entry(FAT, 0, 0xf00 | BS.media_type);
+    set_fat_entry(FAT, 1, 0xfff);
+    for (uint32_t i = 0; i < image.extentCount; i++) {
+      struct mkimage_node_t *node = &image.nodes[image.extents[i]];
+      for (uint32_t j = 0; j < node->clusters; j++) {
+        set_fat_entry(FAT, node->firstCluster + j, j + 1 == node->clusters ? 0xfff : node->firstCluster + j + 1);
+      }
+    }
+    for (int i = 1; i < BS.FATs; i++) {
+      memcpy(FAT + i * FAT_in_bytes, FAT, FAT_in_bytes);
+    }
+    mkimageDirectory(&image, 0, (FileEntry_t *)(header + root_offset));
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      printf("Couldn't create %s\n", output);
+    }
+    success = fd >= 0 && write(fd, header, data_offset) == data_offset;
+  }
+  pthread_t workers[MKIMAGE_THREADS];
+  int started = 0;
+  if (success) {
+    pthread_mutex_init(&image.lock, NULL);
+    pthread_cond_init(&image.changed, NULL);
+    for (int i = 0; i < MKIMAGE_SLOTS && success; i++) {
+      image.slots[i] = malloc(MKIMAGE_WINDOW);
+      success = image.slots[i] != NULL;
+    }
+    image.windowCount = (image.dataSize + MKIMAGE_WINDOW - 1) / MKIMAGE_WINDOW;
+    image.failed = !success;
+    while (success && started < MKIMAGE_THREADS && pthread_create(&workers[started], NULL, mkimageWorker, &image) == 0) {
+      started++;
+    }
+    // host files are read by the workers while this thread writes the windows they filled, in order
+    for (uint32_t window = 0; success && window < image.windowCount; window++) {
+      uint32_t slot = window % MKIMAGE_SLOTS;
+      pthread_mutex_lock(&image.lock);
+      while (!image.ready[slot] && !image.failed) {
+        pthread_cond_wait(&image.changed, &image.lock);
+      }
+      success = !image.failed;
+      pthread_mutex_unlock(&image.lock);
+      uint64_t length = MIN(MKIMAGE_WINDOW, image.dataSize - (uint64_t)window * MKIMAGE_WINDOW);
+      success = success && write(fd, image.slots[slot], length) == length;
+      pthread_mutex_lock(&image.lock);
+      image.ready[slot] = false;
+      image.written++;
+      image.failed |= !success;
+      pthread_cond_broadcast(&image.changed);
+      pthread_mutex_unlock(&image.lock);
+    }
+    for (int i = 0; i < started; i++) {
+      pthread_join(workers[i], NULL);
+    }
+    success = success && started > 0;
+    pthread_mutex_destroy(&image.lock);
+    pthread_cond_destroy(&image.changed);
+  }
+  if (fd >= 0) {
+    success = close(fd) == 0 && success;
+  }
+  uint32_t files = 0;
+  for (uint32_t i = 0; i < image.count; i++) {
+    files += !image.nodes[i].directory;
+    free(image.nodes[i].hostPath);
+    free(image.nodes[i].entries);
+  }
+  if (success) {
+    printf("%s: %u files, %u directories, %u clusters of %u bytes, %lu bytes\n", output, files, image.count - files - 1,
+           image.clusters, image.clusterSize, data_offset + image.dataSize);
+  } else if (fd >= 0) {
+    printf("Couldn't build %s\n", output);
+  }
+  for (int i = 0; i < MKIMAGE_SLOTS; i++) {
+    free(image.slots[i]);
+  }
+  free(image.nodes);
+  free(image.extents);
+  free(header);
+  return success ? 0 : 1;
+}
+
+static int compareStrings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool mkimageScan(struct mkimage_t *image, uint32_t directory, uint32_t depth) {
+  // adds the directory's files and subdirectories as consecutive nodes, sorted by name so that
+  // the same tree always gives the same image, then does the same for every subdirectory
+  DIR *dir = opendir(image->nodes[directory].hostPath);
+  if (dir == NULL) {
+    printf("Couldn't open %s\n", image->nodes[directory].hostPath);
+    return false;
+  }
+  char **names = NULL;
+  uint32_t name_count = 0, name_capacity = 0;
+  bool success = true;
+  for (struct dirent *item = readdir(dir); success && item != NULL; item = readdir(dir)) {
+    if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+      continue;
+    }
+    if (name_count == name_capacity) {
+      name_capacity = MAX(name_capacity * 2, 64);
+      char **grown = realloc(names, name_capacity * sizeof(char *));
+      success = grown != NULL;
+      names = grown ? grown : names;
+    }
+    if (success) {
+      names[name_count] = strdup(item->d_name);
+      success = names[name_count++] != NULL;
+    }
+  }
+  closedir(dir);
+  if (success) {
+    qsort(names, name_count, sizeof(char *), compareStrings);
+  }
+  uint32_t first = image->count;
+  for (uint32_t i = 0; success && i < name_count; i++) {
+    struct stat info;
+    size_t length = strlen(image->nodes[directory].hostPath) + strlen(names[i]) + 2;
+    char *path = malloc(length);
+    if (path == NULL) {
+      success = false;
+      break;
+    }
+    snprintf(path, length, "%s/%s", image->nodes[directory].hostPath, names[i]);
+    if (stat(path, &info) != 0 || !(S_ISDIR(info.st_mode) || S_ISREG(info.st_mode))) {
+      // sockets, devices and broken links have nothing to copy
+      free(path);
+      continue;
+    }
+    if (S_ISREG(info.st_mode) && info.st_size > UINT32_MAX) {
+      printf("%s is too big for a FAT volume\n", path);
+      free(path);
+      success = false;
+      break;
+    }
+    if (image->count == image->capacity) {
+      struct mkimage_node_t *grown = realloc(image->nodes, image->capacity * 2 * sizeof(struct mkimage_node_t));
+      if (grown == NULL) {
+        free(path);
+        success = false;
+        break;
+      }
+      image->nodes = grown;
+      image->capacity *= 2;
+    }
+    struct mkimage_node_t *node = &image->nodes[image->count];
+    memset(node, 0, sizeof(*node));
+    node->hostPath = path;
+    node->directory = S_ISDIR(info.st_mode);
+    node->parent = directory;
+    node->size = node->directory ? 0 : info.st_size;
+    node->modified = info.st_mtime;
+    mkimageAlias(image, first, image->count, names[i]);
+    image->count++;
+  }
+  for (uint32_t i = 0; i < name_count; i++) {
+    free(names[i]);
+  }
+  free(names);
+  image->nodes[directory].firstChild = first;
+  image->nodes[directory].childCount = image->count - first;
+  uint32_t last = image->count;
+  for (uint32_t i = first; success && i < last; i++) {
+    if (!image->nodes[i].directory) {
+      continue;
+    }
+    if (depth + 2 >= MAX_DEPTH) {
+      printf("%s is nested too deep\n", image->nodes[i].hostPath);
+      return false;
+    }
+    success = mkimageScan(image, i, depth + 1);
+  }
+  return success;
+}
+
+static void mkimageAlias(struct mkimage_t *image, uint32_t first, uint32_t index, const char *name) {
+  // the 8.3 name of a node, names that don't fit become NAME~N.EXT the way other systems shorten them
+  uint8_t *short_name = image->nodes[index].shortName;
+  bool unique = makeShortName(name, short_name);
+  for (uint32_t suffix = 1; true; suffix++) {
+    for (uint32_t i = first; unique && i < index; i++) {
+      unique = memcmp(image->nodes[i].shortName, short_name, 11) != 0;
+    }
+    if (unique) {
+      return;
+    }
+    char tail[12];
+    int tail_length = snprintf(tail, sizeof(tail), "~%u", suffix);
+    const char *dot = strrchr(name, '.');
+    dot = dot == name ? NULL : dot;
+    memset(short_name, ' ', 11);
+    int length = 0;
+    for (const char *c = name; *c && c != dot && length < 8 - tail_length; c++) {
+      if (*c != '.' && *c != ' ') {
+        short_name[length++] = (unsigned char)*c > ' ' && (unsigned char)*c < 0x7f && !strchr("\"*+,/:;<=>?[\\]|", *c) ? toupper(*c) : '_';
+      }
+    }
+    memcpy(short_name + length, tail, tail_length);
+    length = 8;
+    for (const char *c = dot ? dot + 1 : ""; *c && length < 11; c++) {
+      if (*c != '.' && *c != ' ') {
+        short_name[length++] = (unsigned char)*c > ' ' && (unsigned char)*c < 0x7f && !strchr("\"*+,/:;<=>?[\\]|", *c) ? toupper(*c) : '_';
+      }
+    }
+    unique = true;
+  }
+}
+
+static bool mkimagePlan(struct mkimage_t *image, BootSector_t *BS) {
+  // picks the smallest cluster size that keeps the volume within FAT12 limits and gives
+  // every node its chain, one after another in node order
+  const uint32_t bytes_per_sector = 512;
+  uint32_t root_entries = MAX(MKIMAGE_MIN_ROOT, (image->nodes[0].childCount + 15) / 16 * 16);
+  uint32_t sectors_per_cluster = 1;
+  for (; sectors_per_cluster <= 64; sectors_per_cluster *= 2) {
+    uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
+    uint64_t clusters = 0;
+    for (uint32_t i = 1; i < image->count && clusters <= MKIMAGE_MAX_CLUSTERS; i++) {
+      struct mkimage_node_t *node = &image->nodes[i];
+      uint64_t size = node->directory ? (node->childCount + 2) * sizeof(FileEntry_t) : node->size;
+      clusters += (size + cluster_size - 1) / cluster_size;
+    }
+    if (clusters <= MKIMAGE_MAX_CLUSTERS) {
+      image->clusterSize = cluster_size;
+      image->clusters = MAX(clusters, 1);
+      break;
+    }
+  }
+  if (root_entries > 0xfff0 || sectors_per_cluster > 64) {
+    printf("The files don't fit in a FAT12 volume\n");
+    return false;
+  }
+  image->extents = malloc(image->count * sizeof(uint32_t));
+  if (image->extents == NULL) {
+    printf("Couldn't allocate memory\n");
+    return false;
+  }
+  uint16_t next = 2;
+  for (uint32_t i = 1; i < image->count; i++) {
+    struct mkimage_node_t *node = &image->nodes[i];
+    uint64_t size = node->directory ? (node->childCount + 2) * sizeof(FileEntry_t) : node->size;
+    node->clusters = (size + image->clusterSize - 1) / image->clusterSize;
+    node->firstCluster = node->clusters ? next : 0;
+    next += node->clusters;
+    if (node->clusters) {
+      image->extents[image->extentCount++] = i;
+    }
+  }
+  image->dataSize = (uint64_t)image->clusters * image->clusterSize;
+  uint32_t FAT_sectors = ((image->clusters + 2) * 3 / 2 + bytes_per_sector) / bytes_per_sector;
+  uint32_t root_sectors = root_entries * sizeof(FileEntry_t) / bytes_per_sector;
+  uint32_t sectors = 1 + 2 * FAT_sectors + root_sectors + image->clusters * sectors_per_cluster;
+  memset(BS, 0, sizeof(BootSector_t));
+  memcpy(BS->intructions, "\xeb\x3c\x90", 3);
+  memcpy(BS->OEM, "FATVIEW ", 8);
+  BS->bytes_per_sector = bytes_per_sector;
+  BS->sectors_per_cluster = sectors_per_cluster;
+  BS->reserved_area = 1;
+  BS->FATs = 2;
+  BS->max_files_in_root = root_entries;
+  BS->number_of_sectors_2b = sectors < 0x10000 ? sectors : 0;
+  BS->number_of_sectors_4b = sectors < 0x10000 ? 0 : sectors;
+  BS->media_type = 0xf8;
+  BS->size_of_FAT = FAT_sectors;
+  BS->sectors_per_track = 32;
+  BS->number_of_heads = 64;
+  BS->drive_number = 0x80;
+  BS->ex_boot_signature = 0x29;
+  BS->serial_number = time(NULL);
+  memcpy(BS->volume_label, "NO NAME    ", 11);
+  memcpy(BS->system_type_level, "FAT12   ", 8);
+  BS->signature_value = 0xaa55;
+  return true;
+}
+
+static void mkimageDirectory(struct mkimage_t *image, uint32_t directory, FileEntry_t *entries) {
+  struct mkimage_node_t *node = &image->nodes[directory];
+  uint32_t slot = 0;
+  if (directory != 0) {
+    // . and .. point at the directory and its parent (0 for the root)
+    for (int i = 0; i < 2; i++) {
+      FileEntry_t *dot = &entries[slot++];
+      memset(dot->filename, ' ', 11);
+      memset(dot->filename, '.', i + 1);
+      dot->file_attributes = DIRECTORY;
+      stampEntry(dot, node->modified, true);
+    }
+    entries[0].first_cluster_address_low = node->firstCluster;
+    entries[1].first_cluster_address_low = node->parent > 0 ? image->nodes[node->parent].firstCluster : 0;
+  }
+  for (uint32_t i = 0; i < node->childCount; i++) {
+    struct mkimage_node_t *child = &image->nodes[node->firstChild + i];
+    FileEntry_t *entry = &entries[slot++];
+    memcpy(entry->filename, child->shortName, 11);
+    entry->file_attributes = child->directory ? DIRECTORY : ARCHIVE;
+    stampEntry(entry, child->modified, true);
+    entry->first_cluster_address_low = child->firstCluster;
+    entry->file_size = child->size;
+  }
+}
+
+static bool mkimageFill(struct mkimage_t *image, uint32_t window, uint8_t *buffer) {
+  // copies whatever part of the nodes falls into a window of the data area
+  uint64_t start = (uint64_t)window * MKIMAGE_WINDOW;
+  uint64_t end = MIN(start + MKIMAGE_WINDOW, image->dataSize);
+  memset(buffer, 0, end - start);
+  uint32_t low = 0, high = image->extentCount;
+  while (low < high) {
+    // first node that ends past the start of the window
+    uint32_t middle = (low + high) / 2;
+    struct mkimage_node_t *node = &image->nodes[image->extents[middle]];
+    if ((uint64_t)(node->firstCluster - 2 + node->clusters) * image->clusterSize <= start) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  for (uint32_t i = low; i < image->extentCount; i++) {
+    struct mkimage_node_t *node = &image->nodes[image->extents[i]];
+    uint64_t node_start = (uint64_t)(node->firstCluster - 2) * image->clusterSize;
+    if (node_start >= end) {
+      break;
+    }
+    uint64_t from = MAX(node_start, start);
+    uint64_t to = MIN(node_start + (uint64_t)node->clusters * image->clusterSize, end);
+    if (node->directory) {
+      memcpy(buffer + (from - start), (uint8_t *)node->entries + (from - node_start), to - from);
+      continue;
+    }
+    to = MIN(to, node_start + node->size);
+    int fd = open(node->hostPath, O_RDONLY);
+    if (fd < 0) {
+      printf("Couldn't open %s\n", node->hostPath);
+      return false;
+    }
+    while (from < to) {
+      ssize_t result = pread(fd, buffer + (from - start), to - from, from - node_start);
+      if (result <= 0) {
+        printf("Couldn't read %s\n", node->hostPath);
+        close(fd);
+        return false;
+      }
+      from += result;
+    }
+    close(fd);
+  }
+  return true;
+}
+
+static void *mkimageWorker(void *argument) {
+  struct mkimage_t *image = argument;
+  pthread_mutex_lock(&image->lock);
+  while (!image->failed && image->nextWindow < image->windowCount) {
+    uint32_t window = image->nextWindow;
+    if (window >= image->written + MKIMAGE_SLOTS) {
+      // its slot still holds a window that hasn't been written
+      pthread_cond_wait(&image->changed, &image->lock);
+      continue;
+    }
+    image->nextWindow++;
+    pthread_mutex_unlock(&image->lock);
+    bool filled = mkimageFill(image, window, image->slots[window % MKIMAGE_SLOTS]);
+    pthread_mutex_lock(&image->lock);
+    image->failed |= !filled;
+    image->ready[window % MKIMAGE_SLOTS] = true;
+    pthread_cond_broadcast(&image->changed);
+  }
+  pthread_mutex_unlock(&image->lock);
+  return NULL;
+}
+
+static void collectDiffEntry(FileEntry_t *entry, const char *path, uint32_t depth, void *context) {
+  struct diff_side_t *side = context;
+  if (side->count == side->capacity) {
+    uint32_t capacity = side->capacity ? side->capacity * 2 : 256;
+    struct diff_entry_t *grown = realloc(side->entries, capacity * sizeof(struct diff_entry_t));
+    if (grown == NULL) {
+      side->failed = true;
+      return;
+    }
+    side->entries = grown;
+    side->capacity = capacity;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    side->failed = true;
+    return;
+  }
+  side->entries[side->count].path = copy;
+  side->entries[side->count].entry = *entry;
+  side->count++;
+}
+
+static int compareDiffEntries(const void *a, const void *b) {
+  return strcmp(((const struct diff_entry_t *)a)->path, ((const struct diff_entry_t *)b)->path);
+}
+
+static bool rangeDirty(Volume_t *volume, uint64_t offset, uint64_t size) {
+  // whether any sector of the range was changed since the last flush
+  if (volume->dirty == NULL) {
+    return false;
+  }
+  uint32_t bytes_per_sector = volume->geometry.bytesPerSector;
+  uint64_t last = MIN((offset + size + bytes_per_sector - 1) / bytes_per_sector, volume->geometry.sectorCount);
+  for (uint64_t sector = offset / bytes_per_sector; sector < last; sector++) {
+    if (volume->dirty[sector / 8] & (1 << (sector % 8))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int compareContents(Volume_t *left, FileEntry_t *a, Volume_t *right, FileEntry_t *b, bool shared) {
+  // returns 0 if both files hold the same bytes, 1 if they don't and -1 if either can't be read,
+  // with shared set both volumes were loaded from the same file and a cluster neither changed is skipped
+  if (a->file_size != b->file_size) {
+    return 1;
+  }
+  uint32_t remaining = a->file_size;
+  if (remaining == 0) {
+    return 0;
+  }
+  uint32_t cluster_size = left->geometry.clusterSize;
+  uint32_t other_cluster_size = right->geometry.clusterSize;
+  if (left->dataSection != NULL && right->dataSection != NULL && cluster_size == other_cluster_size) {
+    // both images are in memory, compare the clusters in place without copying the files out,
+    // runs that are contiguous in both chains are compared with one memcmp
+    uint8_t *left_data = (uint8_t *)left->dataSection;
+    uint8_t *right_data = (uint8_t *)right->dataSection;
+    uint32_t left_limit = left->geometry.clusterLimit;
+    uint32_t right_limit = right->geometry.clusterLimit;
+    uint16_t left_cluster = a->first_cluster_address_low;
+    uint16_t right_cluster = b->first_cluster_address_low;
+    while (remaining > 0) {
+      if (!used_entry(left_cluster) || !used_entry(right_cluster) || left_cluster >= left_limit || right_cluster >= right_limit) {
+        return -1;
+      }
+      uint32_t run = 1;
+      uint16_t left_next = get_fat_entry(left->FAT, left_cluster);
+      uint16_t right_next = get_fat_entry(right->FAT, right_cluster);
+      while ((uint64_t)run * cluster_size < remaining && left_next == left_cluster + run && right_next == right_cluster + run &&
+             left_next < left_limit && right_next < right_limit) {
+        left_next = get_fat_entry(left->FAT, left_cluster + run);
+        right_next = get_fat_entry(right->FAT, right_cluster + run);
+        run++;
+      }
+      uint32_t length = MIN((uint64_t)run * cluster_size, remaining);
+      uint64_t left_offset = (uint64_t)(left_cluster - 2) * cluster_size;
+      uint64_t right_offset = (uint64_t)(right_cluster - 2) * cluster_size;
+      bool skip = shared && left_cluster == right_cluster && !rangeDirty(left, left->dataOffset + left_offset, length) &&
+                  !rangeDirty(right, right->dataOffset + right_offset, length);
+      if (!skip && memcmp(left_data + left_offset, right_data + right_offset, length) != 0) {
+        return 1;
+      }
+      remaining -= length;
+      left_cluster = left_next;
+      right_cluster = right_next;
+    }
+    return 0;
+  }
+  // getContents() follows a chain as far as the file size says, it has to stay inside the data area
+  if (!chainReadable(left, a->first_cluster_address_low) || !chainReadable(right, b->first_cluster_address_low)) {
+    return -1;
+  }
+  uint8_t *left_contents = getContents(left, a);
+  uint8_t *right_contents = getContents(right, b);
+  int result = -1;
+  if (left_contents != NULL && right_contents != NULL) {
+    result = memcmp(left_contents, right_contents, a->file_size) != 0;
+  }
+  free(left_contents);
+  free(right_contents);
+  return result;
+}
+
+static void *diffWorker(void *argument) {
+  struct diff_jobs_t *jobs = argument;
+  while (true) {
+    uint32_t index = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+    if (index >= jobs->count) {
+      break;
+    }
+    struct diff_pair_t *pair = &jobs->pairs[index];
+    pair->contents = compareContents(jobs->left, &pair->left->entry, jobs->right, &pair->right->entry, jobs->shared);
+  }
+  return NULL;
+}
+
+static void *diffWalkWorker(void *argument) {
+  // walks whole subtrees, each into its own list so the workers never share one
+  struct diff_walks_t *walks = argument;
+  char path[PATH_SIZE];
+  while (true) {
+    uint32_t index = __atomic_fetch_add(&walks->next, 1, __ATOMIC_RELAXED);
+    if (index >= walks->count) {
+      break;
+    }
+    struct diff_walk_t *walk = &walks->walks[index];
+    snprintf(path, sizeof(path), "%s", walk->path);
+    walkDirectory(walk->volume, &walk->directory, path, 1, collectDiffEntry, &walk->side);
+  }
+  return NULL;
+}
+
+static void runDiffWorkers(void *(*worker)(void *), void *jobs) {
+  // runs worker on as many threads as there are processors (up to DIFF_THREADS), this one included
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t threads = cpus < 1 ? 1 : cpus > DIFF_THREADS ? DIFF_THREADS : cpus;
+  pthread_t workers[DIFF_THREADS];
+  uint32_t started = 0;
+  while (started + 1 < threads && pthread_create(&workers[started], NULL, worker, jobs) == 0) {
+    started++;
+  }
+  worker(jobs);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+static bool collectDiffSide(Volume_t *volume, struct diff_side_t *side, struct diff_walks_t *walks) {
+  // the root directory is listed here, every directory in it becomes a subtree for the workers
+  FileEntry_t *entries = volume->rootEntries;
+  uint32_t capacity = volume->BS->max_files_in_root;
+  char path[PATH_SIZE];
+  for (uint32_t i = 0; i < capacity && !lastEntry(&entries[i]); i++) {
+    FileEntry_t *entry = &entries[i];
+    if (!liveEntry(entry)) {
+      continue;
+    }
+    char name[13];
+    formatFilename(entry, name);
+    snprintf(path, sizeof(path), "/%s", name);
+    collectDiffEntry(entry, path, 0, side);
+    if (!is_directory(entry) || !chainReadable(volume, entry->first_cluster_address_low)) {
+      continue;
+    }
+    if (walks->count == walks->capacity) {
+      uint32_t grown_capacity = walks->capacity ? walks->capacity * 2 : 64;
+      struct diff_walk_t *grown = realloc(walks->walks, grown_capacity * sizeof(struct diff_walk_t));
+      if (grown == NULL) {
+        return false;
+      }
+      walks->walks = grown;
+      walks->capacity = grown_capacity;
+    }
+    struct diff_walk_t *walk = &walks->walks[walks->count];
+    memset(walk, 0, sizeof(*walk));
+    walk->path = strdup(path);
+    if (walk->path == NULL) {
+      return false;
+    }
+    walk->volume = volume;
+    walk->directory = *entry;
+    walks->count++;
+  }
+  return !side->failed;
+}
+
+static bool mergeDiffSide(struct diff_side_t *side, struct diff_side_t *subtree) {
+  // moves the entries of a subtree to the end of the side, subtree is empty afterwards
+  if (subtree->failed) {
+    return false;
+  }
+  if (side->count + subtree->count > side->capacity) {
+    uint32_t capacity = side->count + subtree->count;
+    struct diff_entry_t *grown = realloc(side->entries, capacity * sizeof(struct diff_entry_t));
+    if (grown == NULL) {
+      return false;
+    }
+    side->entries = grown;
+    side->capacity = capacity;
+  }
+  memcpy(side->entries + side->count, subtree->entries, subtree->count * sizeof(struct diff_entry_t));
+  side->count += subtree->count;
+  free(subtree->entries);
+  memset(subtree, 0, sizeof(*subtree));
+  return true;
+}
+
+static bool sameMetadata(FileEntry_t *a, FileEntry_t *b) {
+  return a->file_attributes == b->file_attributes && a->file_size == b->file_size &&
+         a->creation_time == b->creation_time && a->creation_date == b->creation_date &&
+         a->modified_time == b->modified_time && a->modified_date == b->modified_date &&
+         a->access_date == b->access_date;
+}
+
+static void describeChanges(FileEntry_t *a, FileEntry_t *b, int contents) {
+  // prints what changed between two versions of an entry
+  bool changed = false;
+  if (a->file_attributes != b->file_attributes) {
+    printf("%s attributes 0x%.2hhx -> 0x%.2hhx", changed ? "," : "", a->file_attributes, b->file_attributes);
+    changed = true;
+  }
+  if (a->file_size != b->file_size) {
+    printf("%s size %u -> %u", changed ? "," : "", a->file_size, b->file_size);
+    changed = true;
+  }
+  if (a->creation_time != b->creation_time || a->creation_date != b->creation_date) {
+    printf("%s created ", changed ? "," : "");
+    printFullDate(a->creation_time, a->creation_date);
+    printf(" -> ");
+    printFullDate(b->creation_time, b->creation_date);
+    changed = true;
+  }
+  if (a->modified_time != b->modified_time || a->modified_date != b->modified_date) {
+    printf("%s modified ", changed ? "," : "");
+    printFullDate(a->modified_time, a->modified_date);
+    printf(" -> ");
+    printFullDate(b->modified_time, b->modified_date);
+    changed = true;
+  }
+  if (a->access_date != b->access_date) {
+    printf("%s accessed ", changed ? "," : "");
+    printDate(a->access_date);
+    printf(" -> ");
+    printDate(b->access_date);
+    changed = true;
+  }
+  if (contents != 0 && a->file_size == b->file_size) {
+    printf("%s %s", changed ? "," : "", contents < 0 ? "contents couldn't be read" : "contents differ");
+  }
+}
+
+static void diffImages(const char *other) {
+  // matches both directory trees by path and compares the files present in both in parallel
+  Volume_t *volume = global_data.volume;
+  // the overlay belongs to the loaded image, the other one is read as it is on disk
+  struct load_options_t options = global_data.options;
+  options.overlay = NULL;
+  Volume_t *otherVolume = volumeOpen(other, options);
+  if (otherVolume == NULL) {
+    return;
+  }
+  struct diff_side_t left = {0}, right = {0};
+  struct diff_jobs_t jobs = {0};
+  struct diff_walks_t walks = {0};
+  // the subtrees below both roots are walked in parallel, the left ones come first in walks
+  bool collected = collectDiffSide(volume, &left, &walks);
+  uint32_t left_walks = walks.count;
+  collected = collected && collectDiffSide(otherVolume, &right, &walks);
+  if (collected) {
+    runDiffWorkers(diffWalkWorker, &walks);
+  }
+  for (uint32_t i = 0; collected && i < walks.count; i++) {
+    collected = mergeDiffSide(i < left_walks ? &left : &right, &walks.walks[i].side);
+  }
+  uint32_t most_pairs = MAX(left.count, right.count);
+  jobs.pairs = collected ? calloc(most_pairs + 1, sizeof(struct diff_pair_t)) : NULL;
+  if (jobs.pairs == NULL) {
+    printf("  Couldn't allocate memory\n");
+    goto cleanup;
+  }
+  qsort(left.entries, left.count, sizeof(struct diff_entry_t), compareDiffEntries);
+  qsort(right.entries, right.count, sizeof(struct diff_entry_t), compareDiffEntries);
+  for (uint32_t i = 0, j = 0; i < left.count && j < right.count;) {
+    int order = strcmp(left.entries[i].path, right.entries[j].path);
+    if (order == 0) {
+      struct diff_pair_t *pair = &jobs.pairs[jobs.count++];
+      pair->left = &left.entries[i++];
+      pair->right = &right.entries[j++];
+    } else if (order < 0) {
+      i++;
+    } else {
+      j++;
     }
-    if (skippable(&entry)) {
+  }
+  // files present in both images get their contents compared, everything else only needs metadata
+  uint32_t compared = 0;
+  for (uint32_t i = 0; i < jobs.count; i++) {
+    struct diff_pair_t *pair = &jobs.pairs[i];
+    if (is_directory(&pair->left->entry) || is_directory(&pair->right->entry)) {
       continue;
     }
-    if (*entry.filename == '.') {
-      // don't show . and ..
+    jobs.pairs[compared++] = *pair;
+  }
+  struct diff_pair_t *files = jobs.pairs;
+  uint32_t file_pairs = compared;
+  jobs.count = file_pairs;
+  jobs.left = volume;
+  jobs.right = otherVolume;
+  // an image diffed against itself (to see what hasn't been flushed) only compares the changed clusters
+  struct stat left_file, right_file;
+  jobs.shared = volume->image->overlayFd < 0 && fstat(volume->image->fd, &left_file) == 0 && fstat(otherVolume->image->fd, &right_file) == 0 &&
+                left_file.st_dev == right_file.st_dev && left_file.st_ino == right_file.st_ino;
+  runDiffWorkers(diffWorker, &jobs);
+  uint32_t added = 0, removed = 0, changed = 0, identical = 0;
+  for (uint32_t i = 0, j = 0, k = 0; i < left.count || j < right.count;) {
+    int order = i == left.count ? 1 : j == right.count ? -1 : strcmp(left.entries[i].path, right.entries[j].path);
+    if (order < 0) {
+      printf("  - %s\n", left.entries[i++].path);
+      removed++;
       continue;
     }
-    printIndentation(indent);
-    all && (printFullDate(entry.creation_time, entry.creation_date), printf("  "));
-    if (is_directory(&entry)) {
-      printf(CYAN);
-      all && printf("<DIRECTORY>");
+    if (order > 0) {
+      printf("  + %s\n", right.entries[j++].path);
+      added++;
+      continue;
+    }
+    FileEntry_t *a = &left.entries[i].entry;
+    FileEntry_t *b = &right.entries[j].entry;
+    int contents = 0;
+    if (k < file_pairs && files[k].left == &left.entries[i]) {
+      contents = files[k++].contents;
+    }
+    if (is_directory(a) != is_directory(b)) {
+      printf("  ~ %s: %s -> %s\n", left.entries[i].path, is_directory(a) ? "directory" : "file", is_directory(b) ? "directory" : "file");
+      changed++;
+    } else if (contents != 0 || !sameMetadata(a, b)) {
+      printf("  ~ %s:", left.entries[i].path);
+      describeChanges(a, b, contents);
+      printf("\n");
+      changed++;
     } else {
-      all && printf("%u bytes", entry.file_size);
+      identical++;
     }
-    printf("%s", !first_shown && !all && recursive ? CYAN "  \u21B3 " RESET : "  ");
-    first_shown = true;
-    printFilename(&entry);
-    printf(RESET);
-    printf("\n");
-    if (recursive && is_directory(&entry)) {
-      FileEntry_t *subEntries = (FileEntry_t *)getContents(&entry);
-      if (subEntries != NULL) {
-        showDirectoryContents(subEntries, indent + 1, true, all);
+    i++;
+    j++;
+  }
+  printf("  %u added, %u removed, %u changed, %u identical\n", added, removed, changed, identical);
+cleanup:
+  for (uint32_t i = 0; i < left.count; i++) {
+    free(left.entries[i].path);
+  }
+  for (uint32_t i = 0; i < right.count; i++) {
+    free(right.entries[i].path);
+  }
+  for (uint32_t i = 0; i < walks.count; i++) {
+    struct diff_side_t *subtree = &walks.walks[i].side;
+    for (uint32_t j = 0; j < subtree->count; j++) {
+      free(subtree->entries[j].path);
+    }
+    free(subtree->entries);
+    free(walks.walks[i].path);
+  }
+  free(walks.walks);
+  free(left.entries);
+  free(right.entries);
+  free(jobs.pairs);
+  volumeClose(otherVolume);
+}
+
+static void collectBenchEntry(FileEntry_t *entry, const char *path, uint32_t depth, void *context) {
+  struct bench_t *bench = context;
+  if (is_directory(entry) || entry->file_size == 0) {
+    return;
+  }
+  if (bench->count == bench->capacity) {
+    uint32_t capacity = bench->capacity ? bench->capacity * 2 : 64;
+    FileEntry_t *grown = realloc(bench->entries, capacity * sizeof(FileEntry_t));
+    if (grown == NULL) {
+      return;
+    }
+    bench->entries = grown;
+    bench->capacity = capacity;
+  }
+  bench->entries[bench->count++] = *entry;
+}
+
+static double benchContents(struct bench_t *bench, uint32_t iterations) {
+  // returns the time in seconds it took to read every file iterations times
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < iterations; i++) {
+    for (uint32_t j = 0; j < bench->count; j++) {
+      free(getContents(global_data.volume, &bench->entries[j]));
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void runBenchmark(uint32_t iterations) {
+  // reads every file with the specialized and the generic copy loop
+  Volume_t *volume = global_data.volume;
+  struct geometry_t *geometry = &volume->geometry;
+  struct bench_t bench = {0};
+  char *path = calloc(PATH_SIZE, sizeof(char));
+  if (path == NULL) {
+    return;
+  }
+  walkDirectory(volume, NULL, path, 0, collectBenchEntry, &bench);
+  free(path);
+  uint64_t bytes = 0, clusters = 0;
+  for (uint32_t i = 0; i < bench.count; i++) {
+    bytes += bench.entries[i].file_size;
+    clusters += (bench.entries[i].file_size + geometry->clusterSize - 1) / geometry->clusterSize;
+  }
+  bytes *= iterations;
+  clusters *= iterations;
+  printf("  Geometry: %s, %u byte clusters\n", geometry->name, geometry->clusterSize);
+  printf("  Reading %u files %u times (%lu clusters)\n", bench.count, iterations, clusters);
+  copy_chain_t specialized = geometry->copyChain;
+  if (specialized != NULL && volume->dataSection != NULL) {
+    double seconds = benchContents(&bench, iterations);
+    printf("    specialized: %8.3lf s, %8.1lf MB/s, %6.1lf ns per cluster\n", seconds, bytes / seconds / 1e6, seconds * 1e9 / MAX(clusters, 1));
+  } else {
+    printf("    no specialized path for this image\n");
+  }
+  geometry->copyChain = NULL;
+  double seconds = benchContents(&bench, iterations);
+  geometry->copyChain = specialized;
+  printf("    generic:     %8.3lf s, %8.1lf MB/s, %6.1lf ns per cluster\n", seconds, bytes / seconds / 1e6, seconds * 1e9 / MAX(clusters, 1));
+  free(bench.entries);
+}
+
+static uint32_t fatTimestamp(uint16_t date, uint16_t time) {
+  // seconds since 1980-01-01, 0 if the date isn't set
+  int32_t year = get_year(date), month = get_month(date), day = get_day(date);
+  if (date == 0 || month < 1 || month > 12 || day < 1) {
+    return 0;
+  }
+  // days since 1970-01-01, counting years from march so that the leap day comes last
+  year -= month <= 2;
+  int32_t era = year / 400;
+  int32_t year_of_era = year - era * 400;
+  int32_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  int32_t days = era * 146097 + day_of_era - 719468 - DAYS_BEFORE_1980;
+  return days * 86400u + get_hours(time) * 3600 + get_minutes(time) * 60 + get_seconds(time);
+}
+
+static void formatTimestamp(uint32_t timestamp, char *buffer, size_t size) {
+  // inverse of fatTimestamp(), YYYY-MM-DD HH:MM:SS
+  int32_t days = timestamp / 86400 + DAYS_BEFORE_1980 + 719468;
+  uint32_t seconds = timestamp % 86400;
+  int32_t era = days / 146097;
+  int32_t day_of_era = days - era * 146097;
+  int32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  int32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int32_t shifted_month = (5 * day_of_year + 2) / 153;
+  int32_t day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+  int32_t month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+  int32_t year = year_of_era + era * 400 + (month <= 2);
+  snprintf(buffer, size, "%d-%.2d-%.2d %.2u:%.2u:%.2u", year, month, day, seconds / 3600, seconds / 60 % 60, seconds % 60);
+}
+
+static bool tableGrow(struct entry_table_t *table) {
+  uint32_t capacity = table->capacity ? table->capacity * 2 : 256;
+  void *columns[] = {
+    realloc(table->parent, capacity * sizeof(int32_t)),
+    realloc(table->subtreeEnd, capacity * sizeof(uint32_t)),
+    realloc(table->nameOffset, capacity * sizeof(uint32_t)),
+    realloc(table->attributes, capacity * sizeof(uint8_t)),
+    realloc(table->size, capacity * sizeof(uint32_t)),
+    realloc(table->firstCluster, capacity * sizeof(uint16_t)),
+    realloc(table->created, capacity * sizeof(uint32_t)),
+    realloc(table->modified, capacity * sizeof(uint32_t)),
+    realloc(table->accessed, capacity * sizeof(uint32_t)),
+  };
+  // whatever got reallocated is kept even if another column failed, so nothing leaks
+  table->parent = columns[0] ? columns[0] : table->parent;
+  table->subtreeEnd = columns[1] ? columns[1] : table->subtreeEnd;
+  table->nameOffset = columns[2] ? columns[2] : table->nameOffset;
+  table->attributes = columns[3] ? columns[3] : table->attributes;
+  table->size = columns[4] ? columns[4] : table->size;
+  table->firstCluster = columns[5] ? columns[5] : table->firstCluster;
+  table->created = columns[6] ? columns[6] : table->created;
+  table->modified = columns[7] ? columns[7] : table->modified;
+  table->accessed = columns[8] ? columns[8] : table->accessed;
+  for (int i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+    if (columns[i] == NULL) {
+      return false;
+    }
+  }
+  table->capacity = capacity;
+  return true;
+}
+
+static bool tableAddDirectory(Volume_t *volume, FileEntry_t *directory, int32_t parent, uint32_t depth) {
+  // appends the directory's entries in depth first order, so every subtree is a range of rows
+  struct entry_table_t *table = &volume->table;
+  FileEntry_t *entries = (FileEntry_t *)getContents(volume, directory);
+  if (entries == NULL) {
+    return false;
+  }
+  uint32_t capacity = directoryCapacity(volume, directory);
+  bool success = true;
+  for (uint32_t i = 0; success && i < capacity && !lastEntry(&entries[i]); i++) {
+    FileEntry_t *entry = &entries[i];
+    if (!liveEntry(entry)) {
+      continue;
+    }
+    char name[13];
+    formatFilename(entry, name);
+    uint32_t length = strlen(name) + 1;
+    if (table->count == table->capacity && !tableGrow(table)) {
+      success = false;
+      break;
+    }
+    if (table->namesLength + length > table->namesCapacity) {
+      uint32_t names_capacity = MAX(table->namesCapacity * 2, 4096);
+      char *names = realloc(table->names, names_capacity);
+      if (names == NULL) {
+        success = false;
+        break;
+      }
+      table->names = names;
+      table->namesCapacity = names_capacity;
+    }
+    uint32_t row = table->count++;
+    memcpy(table->names + table->namesLength, name, length);
+    table->nameOffset[row] = table->namesLength;
+    table->namesLength += length;
+    table->parent[row] = parent;
+    table->attributes[row] = entry->file_attributes;
+    table->size[row] = entry->file_size;
+    table->firstCluster[row] = entry->first_cluster_address_low;
+    table->created[row] = fatTimestamp(entry->creation_date, entry->creation_time);
+    table->modified[row] = fatTimestamp(entry->modified_date, entry->modified_time);
+    table->accessed[row] = fatTimestamp(entry->access_date, 0);
+    // a directory with a broken chain keeps its row, only what's inside it is left out
+    if (is_directory(entry) && depth + 1 < MAX_DEPTH && chainReadable(volume, entry->first_cluster_address_low)) {
+      success = tableAddDirectory(volume, entry, row, depth + 1);
+    }
+    table->subtreeEnd[row] = table->count;
+  }
+  if (directory != NULL) {
+    free(entries);
+  }
+  return success;
+}
+
+static bool buildEntryTable(Volume_t *volume) {
+  memset(&volume->table, 0, sizeof(volume->table));
+  return tableAddDirectory(volume, NULL, -1, 0);
+}
+
+static void freeEntryTable(struct entry_table_t *table) {
+  free(table->parent);
+  free(table->subtreeEnd);
+  free(table->nameOffset);
+  free(table->attributes);
+  free(table->size);
+  free(table->firstCluster);
+  free(table->created);
+  free(table->modified);
+  free(table->accessed);
+  free(table->names);
+  memset(table, 0, sizeof(*table));
+}
+
+static size_t tablePath(struct entry_table_t *table, uint32_t row, char *buffer, size_t size) {
+  // builds the full path of a row by following the parent column
+  uint32_t chain[MAX_DEPTH];
+  uint32_t depth = 0;
+  for (int32_t current = row; current >= 0 && depth < MAX_DEPTH; current = table->parent[current]) {
+    chain[depth++] = current;
+  }
+  size_t length = 0;
+  buffer[0] = 0;
+  while (depth > 0 && length < size) {
+    length += snprintf(buffer + length, size - length, "/%s", table->names + table->nameOffset[chain[--depth]]);
+  }
+  return length;
+}
+
+static int32_t tableLookup(struct entry_table_t *table, const char *path) {
+  // returns the row of an absolute path, -1 for the root and -2 if there's no such entry
+  char *dup = strdup(path);
+  if (dup == NULL) {
+    return -2;
+  }
+  int32_t current = -1;
+  char *saveptr = NULL;
+  for (char *chunk = strtok_r(dup, "/", &saveptr); chunk != NULL; chunk = strtok_r(NULL, "/", &saveptr)) {
+    uint32_t first = current < 0 ? 0 : current + 1;
+    uint32_t last = current < 0 ? table->count : table->subtreeEnd[current];
+    int32_t found = -2;
+    for (uint32_t i = first; i < last; i = table->subtreeEnd[i]) {
+      // only direct children, skipping over their subtrees
+      if (strcasecmp(table->names + table->nameOffset[i], chunk) == 0) {
+        found = i;
+        break;
+      }
+    }
+    if (found == -2) {
+      free(dup);
+      return -2;
+    }
+    current = found;
+  }
+  free(dup);
+  return current;
+}
+
+static void scanColumn(const uint32_t *column, uint8_t *mask, uint32_t first, uint32_t last, enum find_operator operator, uint32_t value) {
+  // one branch free loop per operator so that the compiler can vectorize it
+  switch (operator) {
+    case find_less:
+      for (uint32_t i = first; i < last; i++) mask[i] &= column[i] < value;
+      break;
+    case find_less_equal:
+      for (uint32_t i = first; i < last; i++) mask[i] &= column[i] <= value;
+      break;
+    case find_greater:
+      for (uint32_t i = first; i < last; i++) mask[i] &= column[i] > value;
+      break;
+    case find_greater_equal:
+      for (uint32_t i = first; i < last; i++) mask[i] &= column[i] >= value;
+      break;
+    case find_equal:
+      for (uint32_t i = first; i < last; i++) mask[i] &= column[i] == value;
+      break;
+  }
+}
+
+static const char *parseOperator(const char *argument, enum find_operator *operator, enum find_operator fallback) {
+  if (strncmp(argument, ">=", 2) == 0 || strncmp(argument, "<=", 2) == 0) {
+    *operator = argument[0] == '>' ? find_greater_equal : find_less_equal;
+    return argument + 2;
+  }
+  if (*argument == '>' || *argument == '+') {
+    *operator = find_greater;
+    return argument + 1;
+  }
+  if (*argument == '<' || *argument == '-') {
+    *operator = find_less;
+    return argument + 1;
+  }
+  if (*argument == '=') {
+    *operator = find_equal;
+    return argument + 1;
+  }
+  *operator = fallback;
+  return argument;
+}
+
+static bool parseSize(const char *argument, uint32_t *size) {
+  char *end;
+  unsigned long long value = strtoull(argument, &end, 10);
+  if (end == argument) {
+    return false;
+  }
+  switch (tolower(*end)) {
+    case 'k': value <<= 10; end++; break;
+    case 'm': value <<= 20; end++; break;
+    case 'g': value <<= 30; end++; break;
+  }
+  *size = value > UINT32_MAX ? UINT32_MAX : value;
+  return *end == 0;
+}
+
+static bool parseTimestamp(const char *argument, uint32_t *timestamp) {
+  // YYYY-MM-DD with an optional time, HH:MM or HH:MM:SS after a space or a T
+  unsigned year, month, day, hours = 0, minutes = 0, seconds = 0;
+  int matched = sscanf(argument, "%u-%u-%u%*[ T]%u:%u:%u", &year, &month, &day, &hours, &minutes, &seconds);
+  if (matched < 3 || year < 1980 || year > 2107 || month < 1 || month > 12 || day < 1 || day > 31) {
+    return false;
+  }
+  uint16_t date = ((year - 1980) << 9) | (month << 5) | day;
+  uint16_t time = (hours << 11) | (minutes << 5) | (seconds / 2);
+  *timestamp = fatTimestamp(date, time) + seconds % 2;
+  return true;
+}
+
+static uint32_t *sortColumn(struct entry_table_t *table, const char *field) {
+  if (strcmp(field, "size") == 0) return table->size;
+  if (strcmp(field, "created") == 0 || strcmp(field, "ctime") == 0) return table->created;
+  if (strcmp(field, "modified") == 0 || strcmp(field, "mtime") == 0) return table->modified;
+  if (strcmp(field, "accessed") == 0 || strcmp(field, "atime") == 0) return table->accessed;
+  return NULL;
+}
+
+static int compareRows(const void *a, const void *b, void *context) {
+  struct find_sort_t *sort = context;
+  uint32_t left = *(const uint32_t *)a, right = *(const uint32_t *)b;
+  int order;
+  if (sort->column != NULL) {
+    order = (sort->column[left] > sort->column[right]) - (sort->column[left] < sort->column[right]);
+  } else {
+    order = strcmp(sort->table->names + sort->table->nameOffset[left], sort->table->names + sort->table->nameOffset[right]);
+  }
+  if (order == 0) {
+    // keep the tree order between equal rows
+    order = (left > right) - (left < right);
+    return order;
+  }
+  return sort->descending ? -order : order;
+}
+
+static uint32_t *runQuery(Volume_t *volume, char **arguments, int count, uint32_t *matches, char *error, size_t error_size) {
+  // find [path] [-size N] [-mtime|-ctime|-atime DATE] [-type f|d] [-attr rhsad] [-name GLOB]
+  //      [-sort size|name|mtime|ctime|atime] [-desc] [-top N]
+  // every filter narrows a selection mask with a scan over one column of the entry table,
+  // nothing is printed, a query that can't be run returns NULL with the reason in error
+  struct entry_table_t *table = &volume->table;
+  uint32_t first = 0, last = table->count;
+  int index = 0;
+  if (index < count && arguments[index][0] != '-') {
+    int32_t row = tableLookup(table, arguments[index]);
+    if (row == -2) {
+      snprintf(error, error_size, "%s not found.", arguments[index]);
+      return NULL;
+    }
+    if (row >= 0) {
+      first = row + 1;
+      last = table->subtreeEnd[row];
+    }
+    index++;
+  }
+  uint8_t *mask = malloc(table->count + 1);
+  uint32_t *rows = malloc((table->count + 1) * sizeof(uint32_t));
+  if (mask == NULL || rows == NULL) {
+    free(mask);
+    free(rows);
+    snprintf(error, error_size, "Couldn't allocate memory");
+    return NULL;
+  }
+  memset(mask, 1, table->count + 1);
+  struct find_sort_t sort = {table, NULL, false, false};
+  uint32_t top = UINT32_MAX;
+  for (; index < count; index++) {
+    const char *option = arguments[index];
+    const char *value = index + 1 < count ? arguments[index + 1] : NULL;
+    enum find_operator operator;
+    uint32_t number;
+    if (strcmp(option, "-desc") == 0) {
+      sort.descending = true;
+      continue;
+    }
+    if (value == NULL) {
+      snprintf(error, error_size, "%s needs a value.", option);
+      goto error;
+    }
+    index++;
+    if (strcmp(option, "-size") == 0) {
+      const char *size = parseOperator(value, &operator, find_equal);
+      if (!parseSize(size, &number)) {
+        snprintf(error, error_size, "Invalid size '%s'.", value);
+        goto error;
+      }
+      scanColumn(table->size, mask, first, last, operator, number);
+    } else if (strcmp(option, "-mtime") == 0 || strcmp(option, "-ctime") == 0 || strcmp(option, "-atime") == 0) {
+      const char *date = parseOperator(value, &operator, find_greater_equal);
+      if (!parseTimestamp(date, &number)) {
+        snprintf(error, error_size, "Invalid date '%s', use YYYY-MM-DD[THH:MM[:SS]].", value);
+        goto error;
+      }
+      uint32_t *column = option[1] == 'm' ? table->modified : option[1] == 'c' ? table->created : table->accessed;
+      scanColumn(column, mask, first, last, operator, number);
+    } else if (strcmp(option, "-type") == 0) {
+      uint8_t want = *value == 'd' ? DIRECTORY : 0;
+      for (uint32_t i = first; i < last; i++) {
+        mask[i] &= (table->attributes[i] & DIRECTORY) == want;
+      }
+    } else if (strcmp(option, "-attr") == 0) {
+      uint8_t bits = 0;
+      for (const char *c = value; *c; c++) {
+        bits |= *c == 'r' ? FILE_READ_ONLY : *c == 'h' ? HIDDEN_FILE : *c == 's' ? SYSTEM_FILE :
+                *c == 'a' ? ARCHIVE : *c == 'd' ? DIRECTORY : 0;
       }
+      for (uint32_t i = first; i < last; i++) {
+        mask[i] &= (table->attributes[i] & bits) == bits;
+      }
+    } else if (strcmp(option, "-name") == 0) {
+      for (uint32_t i = first; i < last; i++) {
+        mask[i] &= mask[i] && fnmatch(value, table->names + table->nameOffset[i], FNM_CASEFOLD) == 0;
+      }
+    } else if (strcmp(option, "-sort") == 0) {
+      sort.column = sortColumn(table, value);
+      sort.enabled = true;
+      if (sort.column == NULL && strcmp(value, "name") != 0) {
+        snprintf(error, error_size, "Can't sort by '%s'.", value);
+        goto error;
+      }
+    } else if (strcmp(option, "-top") == 0) {
+      int limit = atoi(value);
+      top = limit > 0 ? limit : 0;
+    } else {
+      snprintf(error, error_size, "Unknown option '%s'.", option);
+      goto error;
+    }
+  }
+  uint32_t selected = 0;
+  for (uint32_t i = first; i < last; i++) {
+    rows[selected] = i;
+    selected += mask[i];
+  }
+  if (sort.enabled) {
+    qsort_r(rows, selected, sizeof(uint32_t), compareRows, &sort);
+  }
+  free(mask);
+  *matches = selected < top ? selected : top;
+  return rows;
+error:
+  free(mask);
+  free(rows);
+  return NULL;
+}
+
+static void findEntries(char **arguments, int count) {
+  Volume_t *volume = global_data.volume;
+  struct entry_table_t *table = &volume->table;
+  uint32_t matches;
+  char error[QUERY_ERROR_SIZE];
+  uint32_t *rows = runQuery(volume, arguments, count, &matches, error, sizeof(error));
+  if (rows == NULL) {
+    printf("  %s\n", error);
+    return;
+  }
+  char *path = malloc(PATH_SIZE);
+  char modified[32];
+  for (uint32_t i = 0; path != NULL && i < matches; i++) {
+    uint32_t row = rows[i];
+    tablePath(table, row, path, PATH_SIZE);
+    formatTimestamp(table->modified[row], modified, sizeof(modified));
+    if (table->attributes[row] & DIRECTORY) {
+      printf("  %s  %12s  " CYAN "%s" RESET "\n", modified, "<DIRECTORY>", path);
+    } else {
+      printf("  %s  %12u  %s\n", modified, table->size[row], path);
+    }
+  }
+  printf("  %u %s\n", matches, matches == 1 ? "match" : "matches");
+  free(path);
+  free(rows);
+}
+
+int32_t volumeLookup(Volume_t *volume, const char *path) {
+  return tableLookup(&volume->table, path);
+}
+
+size_t volumePath(Volume_t *volume, uint32_t row, char *buffer, size_t size) {
+  return tablePath(&volume->table, row, buffer, size);
+}
+
+uint32_t *volumeFind(Volume_t *volume, char **arguments, int count, uint32_t *matches, char *error, size_t error_size) {
+  return runQuery(volume, arguments, count, matches, error, error_size);
+}
+
+struct extent_t *volumeExtents(Volume_t *volume, uint32_t row, uint32_t offset, uint32_t length, uint32_t *count) {
+  // maps a byte range of a file to ranges of the image, adjacent clusters are merged into one extent
+  // only reads the FAT and the entry table, so any number of threads can call it at once
+  struct entry_table_t *table = &volume->table;
+  uint32_t cluster_size = volume->geometry.clusterSize;
+  uint32_t size = table->size[row];
+  *count = 0;
+  if (offset >= size) {
+    return calloc(1, sizeof(struct extent_t));
+  }
+  length = MIN(length, size - offset);
+  struct extent_t *extents = malloc((length / cluster_size + 2) * sizeof(struct extent_t));
+  if (extents == NULL) {
+    return NULL;
+  }
+  uint16_t cluster = table->firstCluster[row];
+  for (uint32_t skipped = offset / cluster_size; skipped > 0; skipped--) {
+    if (!used_entry(cluster)) {
+      free(extents);
+      return NULL;
+    }
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+  uint32_t inside = offset % cluster_size;
+  uint32_t guard = volume->geometry.clusterCount;
+  while (length > 0) {
+    if (!used_entry(cluster) || guard-- == 0) {
+      free(extents);
+      return NULL;
+    }
+    uint64_t position = volume->dataOffset + (uint64_t)(cluster - 2) * cluster_size + inside;
+    uint32_t piece = MIN(length, cluster_size - inside);
+    struct extent_t *last = *count > 0 ? &extents[*count - 1] : NULL;
+    if (last != NULL && last->offset + last->length == position) {
+      last->length += piece;
+    } else {
+      extents[(*count)++] = (struct extent_t){position, piece};
     }
+    length -= piece;
+    inside = 0;
+    cluster = get_fat_entry(volume->FAT, cluster);
+  }
+  return extents;
+}
+
+void volumeUsage(Volume_t *volume, struct usage_t *usage) {
+  // only the clusters the volume actually has, the FAT may have room for more
+  memset(usage, 0, sizeof(*usage));
+  for (uint32_t i = 2; i < volume->geometry.clusterLimit; i++) {
+    uint16_t entry = get_fat_entry(volume->FAT, i);
+    usage->used += used_entry(entry) || last_entry(entry);
+    usage->free += free_entry(entry);
+    usage->bad += bad_entry(entry);
+    usage->ending += last_entry(entry);
   }
 }
 
@@ -650,8 +4207,12 @@ static bool lastEntry(FileEntry_t *entry) {
 static void handleCommand(char *command) {
   const char *first = strtok(command, " ");
   char *second = strtok(NULL, " ");
+  char *rest = strtok(NULL, "");
+  if (first == NULL) {
+    return;
+  }
   if (strcmp("rootinfo", first) == 0) {
-    BootSector_t *BS = global_data.BS;
+    BootSector_t *BS = global_data.volume->BS;
     uint32_t entries = countRootEntries();
     double percentage = ((double)entries / BS->max_files_in_root) * 100.00;
     printf("  Max entries in root directory %hu\n", BS->max_files_in_root);
@@ -660,8 +4221,8 @@ static void handleCommand(char *command) {
     return;
   }
   if (strcmp("spaceinfo", first) == 0) {
-    uint8_t *FAT = global_data.FAT;
-    BootSector_t *BS = global_data.BS;
+    uint8_t *FAT = global_data.volume->FAT;
+    BootSector_t *BS = global_data.volume->BS;
     uint32_t bytes = BS->size_of_FAT * BS->bytes_per_sector;
     uint32_t cluster_size = BS->bytes_per_sector * BS->sectors_per_cluster;
     uint32_t FAT_size = BS->size_of_FAT * BS->bytes_per_sector;
@@ -677,12 +4238,33 @@ static void handleCommand(char *command) {
       ending_entries += last_entry(entry);
       used_entries += used_entry(entry);
     }
+    if (global_data.options.json) {
+      Output_t *output = outputOpen(STDOUT_FILENO);
+      if (output == NULL) {
+        return;
+      }
+      fflush(stdout);
+      outputFormat(output, "{\"used_entries\":%u,\"free_entries\":%u,\"bad_entries\":%u,\"ending_entries\":%u,", used_entries, free_entries, bad_entries, ending_entries);
+      outputFormat(output, "\"sectors_per_cluster\":%hhu,\"cluster_size\":%u,\"format\":\"%s\",\"readahead\":", BS->sectors_per_cluster, cluster_size, imageFormatName(global_data.volume->image));
+      if (global_data.volume->readahead != NULL) {
+        outputJSONString(output, readaheadBackendName(global_data.volume->readahead));
+      } else {
+        outputString(output, "null");
+      }
+      outputString(output, "}\n");
+      outputClose(output);
+      return;
+    }
     printf("  Currently there are\n");
     printf("    %u used entries\n", used_entries);
     printf("    %u free entries\n", free_entries);
     printf("    %u bad entries\n", bad_entries);
     printf("    %u entries ending a cluster chain\n", ending_entries);
     printf("  Each cluster is %hhu sectors (%u bytes) long\n", BS->sectors_per_cluster, cluster_size);
+    printf("  Image is stored as %s\n", imageFormatName(global_data.volume->image));
+    if (global_data.volume->readahead != NULL) {
+      printf("  Clusters are read on demand with %s readahead\n", readaheadBackendName(global_data.volume->readahead));
+    }
     return;
   }
   if (strcmp("pwd", first) == 0) {
@@ -720,41 +4302,54 @@ static void handleCommand(char *command) {
   }
   if (strcmp("ls", first) == 0) {
     bool show_all = second != NULL && strcmp(second, "-a") == 0;
+    if (global_data.options.json) {
+      listDirectoryJSON(getCurrentDir(), false);
+      return;
+    }
     showDirectoryContents(getCurrentDir(), 1, false, show_all);
     return;
   }
-  // this works but is only temporary
-  // if (strcmp("rm", first) == 0) {
-  //   if (second == NULL) {
-  //     printf("  No argument supplied!\n");
-  //     return;
-  //   }
-  //   File_t *handle = fileOpen(second);
-  //   if (handle == NULL) {
-  //     printf("  %s not found.\n", second);
-  //     return;
-  //   }
-  //   FileEntry_t *entry = handle->_entry;
-  //   fileClose(handle);
-  //   // go through all FAT entries and set to 0
-  //   uint16_t FAT_entry = entry->first_cluster_address_low;
-  //   uint8_t *FAT = global_data.FAT;
-  //   while (true) {
-  //     uint16_t next_FAT_entry = get_fat_entry(FAT, FAT_entry);
-  //     uint16_t *FAT_entry_address = (uint16_t *)(FAT + (FAT_entry + (FAT_entry / 2)));
-  //     if (FAT_entry & 0x0001) {
-  //       *FAT_entry_address &= 0b0000000000001111;
-  //     } else {
-  //       *FAT_entry_address &= 0b1111000000000000;
-  //     }
-  //     FAT_entry = next_FAT_entry;
-  //     if (last_entry(FAT_entry) || bad_entry(FAT_entry)) {
-  //       break;
-  //     }
-  //   }
-  //   entry->allocation_status = DELETED;
-  //   return;
-  // }
+  if (strcmp("put", first) == 0 || strcmp("rm", first) == 0 || strcmp("mkdir", first) == 0 || strcmp("truncate", first) == 0) {
+    if (second == NULL || (strcmp("truncate", first) == 0 && rest == NULL)) {
+      printf("  No argument supplied!\n");
+      return;
+    }
+    if (!writableVolume()) {
+      return;
+    }
+    if (strcmp("put", first) == 0) {
+      // the file keeps its name unless a path in the image is given
+      const char *base = strrchr(second, '/');
+      putFile(second, rest != NULL ? rest : (char *)(base ? base + 1 : second));
+    } else if (strcmp("rm", first) == 0) {
+      removeEntry(second);
+    } else if (strcmp("mkdir", first) == 0) {
+      makeDirectory(second);
+    } else {
+      uint32_t size;
+      if (!parseSize(rest, &size)) {
+        printf("  Invalid size '%s'.\n", rest);
+        return;
+      }
+      truncateFile(second, size);
+    }
+    refreshEntryTable(global_data.volume);
+    return;
+  }
+  if (strcmp("overlay", first) == 0) {
+    overlayCommand(second, rest);
+    return;
+  }
+  if (strcmp("flush", first) == 0) {
+    uint32_t sectors = global_data.volume->dirtySectors;
+    uint32_t writes;
+    if (!flushVolume(global_data.volume, &writes)) {
+      printf("  Couldn't write the changes to %s.\n", changesTarget(global_data.volume));
+      return;
+    }
+    printf("  %u sectors written in %u %s.\n", sectors, writes, writes == 1 ? "write" : "writes");
+    return;
+  }
   if (strcmp("cat", first) == 0) {
     if (second == NULL) {
       printf("  No argument supplied!\n");
@@ -772,7 +4367,11 @@ static void handleCommand(char *command) {
       printf("  Cannot read %s because it's a directory.\n", second);
       return;
     }
-    uint8_t *contents = getContents(entry);
+    uint8_t *contents = getContents(global_data.volume, entry);
+    if (contents == NULL) {
+      printf("  Couldn't read %s.\n", second);
+      return;
+    }
     for (size_t i = 0; i < file_size; i++) {
       putchar(contents[i]);
     }
@@ -785,6 +4384,15 @@ static void handleCommand(char *command) {
       printf("  No argument supplied!\n");
       return;
     }
+    if (strcmp(second, "-r") == 0) {
+      char *arguments[MAX_ARGUMENTS];
+      int count = 0;
+      for (char *argument = strtok(rest, " "); argument != NULL && count < MAX_ARGUMENTS; argument = strtok(NULL, " ")) {
+        arguments[count++] = argument;
+      }
+      extractTree(arguments, count);
+      return;
+    }
     File_t *handle = fileOpen(second);
     if (handle == NULL) {
       printf("  %s not found.\n", second);
@@ -796,12 +4404,16 @@ static void handleCommand(char *command) {
       printf("  Cannot read %s because it's a directory.\n", second);
       return;
     }
-    uint8_t *contents = getContents(entry);
-    char *filename = getFilename(entry);
+    uint8_t *contents = getContents(global_data.volume, entry);
+    if (contents == NULL) {
+      printf("  Couldn't read %s.\n", second);
+      return;
+    }
+    char filename[13];
+    formatFilename(entry, filename);
     FILE *output = fopen(filename, "w");
     if (output == NULL) {
       free(contents);
-      free(filename);
       printf("  Couldn't create %s.\n", filename);
       return;
     }
@@ -809,7 +4421,6 @@ static void handleCommand(char *command) {
     fclose(output);
     printf("  %s successfully copied to disk.\n", filename);
     free(contents);
-    free(filename);
     return;
   }
   if (strcmp("fileinfo", first) == 0) {
@@ -821,16 +4432,33 @@ static void handleCommand(char *command) {
     File_t *handle = goAndFetch(second, false);
     if (handle == NULL || handle == ROOT) {
       restoreHistory();
-      printf("  %s not found.\n", second);
+      if (global_data.options.json) {
+        writeErrorJSON("not found", second);
+      } else {
+        printf("  %s not found.\n", second);
+      }
       return;
     }
     FileEntry_t *entry = handle->_entry;
     fileClose(handle);
-    char *name = getFilename(entry);
+    if (global_data.options.json) {
+      Output_t *output = outputOpen(STDOUT_FILENO);
+      char path[PATH_SIZE];
+      formatCurrentDirectory(path, sizeof(path) - 13);
+      formatFilename(entry, path + strlen(path));
+      restoreHistory();
+      if (output != NULL) {
+        fflush(stdout);
+        writeEntryJSON(output, entry, path, true);
+        outputClose(output);
+      }
+      return;
+    }
+    char name[13];
+    formatFilename(entry, name);
     printf("  Full name: ");
     printCurrentDirectory();
     printf("%s\n", name);
-    free(name);
     restoreHistory();
     printf("  Attributes: ");
     if (entry->file_attributes & FILE_READ_ONLY) {
@@ -863,7 +4491,7 @@ static void handleCommand(char *command) {
     printf("\n");
     printf("  Cluster chain: ");
     uint16_t FAT_entry = entry->first_cluster_address_low;
-    uint8_t *FAT = global_data.FAT;
+    uint8_t *FAT = global_data.volume->FAT;
     while (true) {
       printf("%hu", FAT_entry);
       FAT_entry = get_fat_entry(FAT, FAT_entry);
@@ -873,16 +4501,81 @@ static void handleCommand(char *command) {
       printf(", ");
     }
     printf("\n");
-    uint32_t clusters = countFATentries(entry);
+    uint32_t clusters = countFATentries(global_data.volume, entry);
     printf("  Clusters: %u\n", clusters);
     return;
   }
   if (strcmp(first, "tree") == 0) {
     bool show_all = second != NULL && strcmp(second, "-a") == 0;
+    if (global_data.options.json) {
+      listDirectoryJSON(NULL, true);
+      return;
+    }
     show_all && printf(CYAN "    root\n" RESET);
     showDirectoryContents(NULL, 1, true, show_all);
     return;
   }
+  if (strcmp(first, "fraginfo") == 0) {
+    showFragmentation();
+    return;
+  }
+  if (strcmp(first, "defrag") == 0) {
+    if (second == NULL) {
+      printf("  No argument supplied!\n");
+      return;
+    }
+    defragment(second);
+    return;
+  }
+  if (strcmp(first, "dump") == 0) {
+    char *arguments[MAX_ARGUMENTS];
+    int count = 0;
+    if (second != NULL) {
+      arguments[count++] = second;
+    }
+    for (char *argument = strtok(rest, " "); argument != NULL && count < MAX_ARGUMENTS; argument = strtok(NULL, " ")) {
+      arguments[count++] = argument;
+    }
+    dumpCommand(arguments, count);
+    return;
+  }
+  if (strcmp(first, "export") == 0) {
+    char *arguments[MAX_ARGUMENTS];
+    int count = 0;
+    if (second != NULL) {
+      arguments[count++] = second;
+    }
+    for (char *argument = strtok(rest, " "); argument != NULL && count < MAX_ARGUMENTS; argument = strtok(NULL, " ")) {
+      arguments[count++] = argument;
+    }
+    exportImage(arguments, count);
+    return;
+  }
+  if (strcmp(first, "diff") == 0) {
+    if (second == NULL) {
+      printf("  No argument supplied!\n");
+      return;
+    }
+    diffImages(second);
+    return;
+  }
+  if (strcmp(first, "bench") == 0) {
+    int iterations = second != NULL ? atoi(second) : 1000;
+    runBenchmark(iterations > 0 ? iterations : 1000);
+    return;
+  }
+  if (strcmp(first, "find") == 0) {
+    char *arguments[MAX_ARGUMENTS];
+    int count = 0;
+    if (second != NULL) {
+      arguments[count++] = second;
+    }
+    for (char *argument = strtok(rest, " "); argument != NULL && count < MAX_ARGUMENTS; argument = strtok(NULL, " ")) {
+      arguments[count++] = argument;
+    }
+    findEntries(arguments, count);
+    return;
+  }
   if (strcmp(first, "help") == 0) {
     printf("  Available commands:\n");
     printf("    tree - show contents of the whole image. Flags (-a print creation date and size)\n");
@@ -891,9 +4584,26 @@ static void handleCommand(char *command) {
     printf("    pwd - print working directory\n");
     printf("    cat <filename> - print file's contents\n");
     printf("    get <filename> - copy file's contents to local folder\n");
+    printf("    dump sector <n> [count] | cluster <n> [count] | file <path> [offset length] - hex dump of the image\n");
+    printf("    get -r <path> <directory> [manifest] - copy a directory to the host, files the manifest of the last run\n");
+    printf("        still matches (size, modification time and clusters) are skipped, then the manifest is updated\n");
     printf("    rootinfo - print information about the root directory\n");
     printf("    spaceinfo - print information about the disk image\n");
     printf("    fileinfo <filename> - print information about the file\n");
+    printf("    fraginfo - print how fragmented the files are\n");
+    printf("    defrag <image> - write a defragmented copy of the image\n");
+    printf("    export [--sparse] [--scrub] <image> - write a copy of the image, --sparse leaves free clusters out as holes,\n");
+    printf("        --scrub also zeroes deleted entries and the slack after the end of files\n");
+    printf("    diff <image> - show what was added, removed or changed in another image\n");
+    printf("    find [path] [filters] - search the whole image. Filters (-size [+-]N[kMG], -mtime/-ctime/-atime [<>=]YYYY-MM-DD,\n");
+    printf("      -type f|d, -attr rhsad, -name glob, -sort size|name|mtime|ctime|atime, -desc, -top N)\n");
+    printf("    bench [iterations] - time reading every file with the specialized and generic code\n");
+    printf("    put <file> [path] - copy a local file into the image\n");
+    printf("    rm <path> - delete a file or an empty directory\n");
+    printf("    mkdir <path> - create a directory\n");
+    printf("    truncate <path> <size> - shrink or grow a file\n");
+    printf("    flush - write the changes made so far to the image (or its overlay)\n");
+    printf("    overlay [commit <image> | discard] - show the overlay, write the image with it to a new file or empty it\n");
     printf("    exit - terminates the program\n");
     return;
   }
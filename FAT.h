@@ -7,6 +7,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
+
+#include "image.h"
+#include "readahead.h"
+#include "output.h"
 
 // file attributes
 #define FILE_READ_ONLY 0x01
@@ -17,6 +22,9 @@
 #define DIRECTORY 0x10
 #define ARCHIVE 0x20
 
+// a long name is at most 255 characters, 13 per entry
+#define LONG_NAME_ENTRIES 20
+
 // allocation statuses
 #define UNALLOCATED 0x00
 #define DELETED 0xe5
@@ -45,8 +53,19 @@
 
 #define BUFFER_SIZE 1024
 #define MAX_DEPTH 100
+#define PATH_SIZE (MAX_DEPTH * 13 + 1)
+#define MAX_CLUSTERS 0xff0
+
+#define DIFF_THREADS 16
+#define MAX_ARGUMENTS 32
+#define DAYS_BEFORE_1980 3652 // since 1970-01-01
+#define UNIX_1980 (DAYS_BEFORE_1980 * 86400u) // seconds between 1970-01-01 and 1980-01-01
+
+#define FRAG_BUCKETS 6
+#define FRAG_WORST 5
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 #define FILE_ERROR (-2)
 #define FILE_END (-3)
@@ -106,57 +125,423 @@ struct _File_t {
   enum file_type _type;
   size_t _size;
   bool _opened;
+  struct _FileEntry _self; // _entry points here for handles that don't come from a path walk
+  // directories only, their entries are read once and kept for lookups and iteration
+  struct _FileEntry *_entries;
+  uint32_t _capacity;
+  uint32_t _index;
 };
 
-struct global_data_t {
+#define FAT_MISMATCHES_SHOWN 10
+// most sectors gathered into one pwritev() when flushing changes
+#define FLUSH_VECTORS 256
+
+// which FAT to trust when the copies differ
+enum fat_policy {fat_primary, fat_majority, fat_fail};
+
+struct load_options_t {
+  bool lazy; // read clusters from the image when needed instead of loading the whole data section
+  enum fat_policy fatPolicy;
+  bool json; // listings and reports are written as one JSON object per line
+  const char *overlay; // changes are written to this file, the image itself is only read
+  bool noReadahead; // lazy volumes read clusters when asked instead of queueing the rest of the chain
+};
+
+struct _Volume;
+
+// every live entry of the volume, one array per field, rows are in depth first order
+struct entry_table_t {
+  uint32_t count;
+  uint32_t capacity;
+  int32_t *parent; // -1 for entries in the root directory
+  uint32_t *subtreeEnd; // rows between this one and subtreeEnd are its descendants
+  uint32_t *nameOffset; // into names
+  uint8_t *attributes;
+  uint32_t *size;
+  uint16_t *firstCluster;
+  uint32_t *created; // seconds since 1980-01-01
+  uint32_t *modified;
+  uint32_t *accessed;
+  char *names;
+  uint32_t namesLength;
+  uint32_t namesCapacity;
+};
+
+// how the clusters of a volume are used, counted from the FAT
+struct usage_t {
+  uint32_t used;
+  uint32_t free;
+  uint32_t bad;
+  uint32_t ending; // last cluster of a chain
+};
+
+// a byte range of a file's contents located in the image
+struct extent_t {
+  uint64_t offset;
+  uint32_t length;
+};
+
+// room for the reason a find query was refused, arguments in it are cut short
+#define QUERY_ERROR_SIZE 256
+
+enum find_operator {find_less, find_less_equal, find_greater, find_greater_equal, find_equal};
+
+struct find_sort_t {
+  struct entry_table_t *table;
+  uint32_t *column; // NULL sorts by name
+  bool descending;
+  bool enabled;
+};
+
+typedef bool (*copy_chain_t)(struct _Volume *volume, uint16_t cluster, uint8_t *destination, uint32_t size);
+
+struct geometry_t {
+  uint32_t bytesPerSector;
+  uint32_t sectorsPerCluster;
+  uint32_t clusterSize;
+  uint32_t clusterShift; // 0 if the cluster size isn't a power of two
+  uint32_t clusterCount;
+  uint32_t clusterLimit; // first cluster number past the end of the volume
+  uint32_t sectorCount;
+  uint64_t FATOffset;
+  uint32_t FATSize; // of one copy, in bytes
+  uint32_t FATCopies;
+  uint64_t rootOffset;
+  uint32_t rootSize;
+  const char *name;
+  copy_chain_t copyChain; // NULL if there's no specialized loop, the data section must be in memory
+};
+
+struct _Volume {
   struct _BootSector *BS;
   uint8_t *FAT; // main FAT
-  struct _FileEntry *dataSection;
+  struct _FileEntry *dataSection; // NULL if clusters are read from the image on demand
   struct _FileEntry *rootEntries;
+  const char *filename;
+  Image_t *image;
+  uint64_t dataOffset; // where the first data cluster starts in the image
+  struct geometry_t geometry;
+  struct entry_table_t table;
+  Readahead_t *readahead; // only used by lazily loaded raw images
+  pthread_mutex_t lock; // serializes reads that go to the image
+  uint8_t *dirty; // one bit per sector changed since the last flush, NULL until the first change
+  uint32_t dirtySectors;
+  uint8_t **changed; // lazily loaded volumes: copies of the clusters being changed, indexed by cluster
+};
+
+struct global_data_t {
+  struct _Volume *volume;
   struct _FileEntry *directoryHistory[MAX_DEPTH];
   struct _FileEntry *historyBackup[MAX_DEPTH];
   uint32_t historyIndex;
   uint32_t historyIndexBackup;
   const char *diskFilename;
+  struct load_options_t options;
+};
+
+struct frag_report_t {
+  uint32_t files;
+  uint32_t directories;
+  uint32_t chains; // files and directories that have clusters
+  uint32_t fragmented;
+  uint32_t fragments;
+  uint32_t histogram[FRAG_BUCKETS]; // 1, 2, 3-4, 5-8, 9-16, 17+ fragments
+  struct {
+    uint32_t fragments;
+    uint32_t clusters;
+    char path[PATH_SIZE];
+  } worst[FRAG_WORST];
+};
+
+struct defrag_t {
+  int fd;
+  uint8_t *FAT;
+  uint32_t clusterSize;
+  uint32_t clusterLimit; // first cluster number past the end of the volume
+  uint32_t next; // where the next chain goes
+};
+
+// dump prints 16 bytes per line like hexdump -C: offset, hex bytes in two groups of 8, then |ascii|
+#define DUMP_CHUNK (1024 * 1024)
+#define DUMP_LINE_SIZE 79
+#define DUMP_HEX_COLUMN 10
+#define DUMP_ASCII_COLUMN 61
+
+// exports are written in runs of clusters of at most this size
+#define EXPORT_CHUNK (1024 * 1024)
+
+struct export_t {
+  bool sparse; // free clusters are left out as holes
+  bool scrub; // deleted entries, file slack and free clusters end up as zeros
+  uint32_t *keep; // scrubbing only: bytes of each cluster that belong to a file, the rest is slack
+  uint8_t *directories; // scrubbing only: one bit per cluster of a directory
+};
+
+// get -r writes what it extracted to a manifest, files that still match it aren't read the next time
+#define MANIFEST_HEADER "# fatview manifest 1: path, size, modified, chain fingerprint, crc32"
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+struct manifest_entry_t {
+  char *path; // relative to the extracted directory
+  uint32_t size;
+  uint32_t modified; // seconds since 1980-01-01, like the entry table
+  uint64_t chain; // FNV-1a of the cluster numbers
+  uint32_t checksum; // crc32 of the contents
+};
+
+struct manifest_t {
+  struct manifest_entry_t *entries;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+struct diff_entry_t {
+  char *path;
+  struct _FileEntry entry;
+};
+
+struct diff_side_t {
+  struct diff_entry_t *entries;
+  uint32_t count;
+  uint32_t capacity;
+  bool failed;
+};
+
+struct diff_pair_t {
+  struct diff_entry_t *left;
+  struct diff_entry_t *right;
+  int contents; // 0 same, 1 different, -1 unreadable
+};
+
+struct diff_jobs_t {
+  struct _Volume *left;
+  struct _Volume *right;
+  struct diff_pair_t *pairs;
+  uint32_t count;
+  uint32_t next; // next pair to be picked up by a worker
+  bool shared; // both volumes come from the same file, clusters neither side changed are equal
+};
+
+struct diff_walk_t {
+  struct _Volume *volume;
+  struct _FileEntry directory; // a directory in the root, walked with everything below it
+  char *path;
+  struct diff_side_t side;
+};
+
+struct diff_walks_t {
+  struct diff_walk_t *walks;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t next; // next subtree to be picked up by a worker
+};
+
+// images are built in windows of the data area, filled by the workers and written in order
+#define MKIMAGE_WINDOW (4 * 1024 * 1024)
+#define MKIMAGE_SLOTS 8
+#define MKIMAGE_THREADS 4
+#define MKIMAGE_MIN_ROOT 224
+// FAT12 has fewer than 4085 clusters and the last numbers are reserved
+#define MKIMAGE_MAX_CLUSTERS (MAX_CLUSTERS - 2)
+
+struct mkimage_node_t {
+  char *hostPath;
+  uint8_t shortName[11];
+  bool directory;
+  int32_t parent; // -1 for the root itself
+  uint32_t firstChild; // children are consecutive nodes
+  uint32_t childCount;
+  uint32_t size;
+  time_t modified;
+  uint16_t firstCluster;
+  uint32_t clusters;
+  struct _FileEntry *entries; // directories, built before writing
+};
+
+struct mkimage_t {
+  struct mkimage_node_t *nodes;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t *extents; // nodes that have clusters, in cluster order
+  uint32_t extentCount;
+  uint32_t clusterSize;
+  uint32_t clusters;
+  uint64_t dataSize;
+  // windows of the data area, a window goes to slot window % MKIMAGE_SLOTS
+  uint8_t *slots[MKIMAGE_SLOTS];
+  bool ready[MKIMAGE_SLOTS];
+  uint32_t windowCount;
+  uint32_t nextWindow; // next one to fill
+  uint32_t written; // windows written so far
+  bool failed;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+struct bench_t {
+  struct _FileEntry *entries;
+  uint32_t count;
+  uint32_t capacity;
 };
 
 typedef struct _FileEntry FileEntry_t;
 typedef struct _BootSector BootSector_t;
 typedef struct _File_t File_t;
+typedef struct _Volume Volume_t;
+typedef void (*walk_callback_t)(FileEntry_t *entry, const char *path, uint32_t depth, void *context);
 
 // internal functions
 
 static FileEntry_t *findEntry(const char *name);
-static uint8_t *getContents(FileEntry_t *entry);
+static bool packName(const char *name, uint8_t *packed);
+static int32_t scanEntries(const FileEntry_t *entries, uint32_t capacity, const uint8_t *packed, uint8_t skip);
+static uint8_t *getContents(Volume_t *volume, FileEntry_t *entry);
+static bool readExtent(Volume_t *volume, uint16_t cluster, uint8_t *destination, uint32_t size);
+static bool readData(Volume_t *volume, uint64_t offset, uint8_t *destination, uint32_t size);
+static void resolveGeometry(Volume_t *volume);
 static void printFilename(FileEntry_t *entry);
-static char *getFilename(FileEntry_t *entry);
+static void formatFilename(FileEntry_t *entry, char *buffer);
 static void printDate(uint16_t date);
 static void printTime(uint16_t time);
 static void printFullDate(uint16_t time, uint16_t date);
 static uint16_t get_fat_entry(uint8_t *FAT, uint16_t index);
-static void dump(void *data, uint32_t size);
+static void set_fat_entry(uint8_t *FAT, uint16_t index, uint16_t value);
+static uint32_t nextMismatch(const uint8_t *a, const uint8_t *b, uint32_t size, uint32_t offset);
+static bool checkFATCopies(uint8_t **FATs, uint32_t copies, uint32_t size, enum fat_policy policy);
+static void dumpLine(char *line, const uint8_t *data, uint32_t count, uint64_t offset);
+static void dump(Output_t *output, const uint8_t *data, uint32_t size, uint64_t offset);
+static bool dumpImage(Output_t *output, Volume_t *volume, uint64_t position, uint64_t size, uint64_t offset);
+static bool parseNumber(const char *argument, uint64_t *value);
+static void dumpCommand(char **arguments, int count);
 static void dumpBSInfo(BootSector_t *BS);
 static void handleCommand(char *command);
 static uint32_t countRootEntries(void);
-static uint32_t countFATentries(FileEntry_t *entry);
+static bool chainReadable(Volume_t *volume, uint16_t cluster);
+static uint32_t countFATentries(Volume_t *volume, FileEntry_t *entry);
 static FileEntry_t *getCurrentDir(void);
 static FileEntry_t *getDirectory(uint32_t index);
 static void printCurrentDirectory(void);
+static void formatCurrentDirectory(char *buffer, size_t size);
+static void writeTimestampJSON(Output_t *output, const char *key, uint32_t timestamp, bool time);
+static void writeEntryJSON(Output_t *output, FileEntry_t *entry, const char *path, bool chain);
+static void collectEntryJSON(FileEntry_t *entry, const char *path, uint32_t depth, void *context);
+static void listDirectoryJSON(FileEntry_t *directory, bool recursive);
+static void writeErrorJSON(const char *error, const char *argument);
 static void showDirectoryContents(FileEntry_t *directory, size_t indent, bool recursive, bool all);
 static void printIndentation(size_t times);
 static File_t *goAndFetch(char *filename, bool reset_depth);
+static FileEntry_t *directoryEntries(File_t *handle);
+static bool lookupEntry(FileEntry_t *entries, uint32_t capacity, const char *name, FileEntry_t *found);
 static void makeHistoryBackup(void);
 static void restoreHistory(void);
 static bool lastEntry(FileEntry_t *entry);
 static bool skippable(FileEntry_t *entry);
+static bool liveEntry(FileEntry_t *entry);
+static uint32_t directoryCapacity(Volume_t *volume, FileEntry_t *directory);
+static void walkDirectory(Volume_t *volume, FileEntry_t *directory, char *path, uint32_t depth, walk_callback_t callback, void *context);
+static uint32_t countFragments(Volume_t *volume, FileEntry_t *entry, uint32_t *clusters);
+static void collectFragmentation(FileEntry_t *entry, const char *path, uint32_t depth, void *context);
+static void showFragmentation(void);
+static bool defragAllocate(struct defrag_t *defrag, uint32_t clusters, uint16_t *first);
+static bool defragWrite(struct defrag_t *defrag, uint16_t cluster, uint8_t *data, uint32_t size);
+static bool defragDirectory(struct defrag_t *defrag, FileEntry_t *directory, uint16_t self, uint16_t parent);
+static const char *loadedFile(Volume_t *volume, const char *name);
+static void defragment(const char *output);
+static void collectExport(FileEntry_t *entry, const char *path, uint32_t depth, void *context);
+static void scrubEntries(FileEntry_t *entries, uint32_t count);
+static void exportImage(char **arguments, int count);
+static uint64_t chainFingerprint(Volume_t *volume, uint16_t cluster);
+static bool addManifestEntry(struct manifest_t *manifest, const char *path, uint32_t size, uint32_t modified, uint64_t chain, uint32_t checksum);
+static int compareManifestEntries(const void *a, const void *b);
+static bool loadManifest(const char *name, struct manifest_t *manifest);
+static bool saveManifest(const char *name, struct manifest_t *manifest);
+static void freeManifest(struct manifest_t *manifest);
+static bool extractFile(Volume_t *volume, uint32_t row, const char *destination, uint32_t *checksum);
+static void extractTree(char **arguments, int count);
+static bool writableVolume(void);
+static void markDirty(Volume_t *volume, uint64_t offset, uint64_t size);
+static uint8_t *clusterData(Volume_t *volume, uint16_t cluster, bool load);
+static void releaseChanged(Volume_t *volume);
+static uint8_t *sectorSource(Volume_t *volume, uint32_t sector);
+static bool flushVolume(Volume_t *volume, uint32_t *writes);
+static void setFATEntry(Volume_t *volume, uint16_t cluster, uint16_t value);
+static uint32_t countFreeClusters(Volume_t *volume);
+static bool allocateClusters(Volume_t *volume, uint32_t count, uint16_t hint, uint16_t *clusters);
+static void linkChain(Volume_t *volume, uint16_t previous, const uint16_t *clusters, uint32_t count);
+static void freeChain(Volume_t *volume, uint16_t cluster);
+static void writeClusters(Volume_t *volume, const uint16_t *clusters, uint32_t count, const uint8_t *data, uint32_t size);
+static bool makeShortName(const char *name, uint8_t *short_name);
+static void stampEntry(FileEntry_t *entry, time_t when, bool created);
+static bool resolveParent(char *path, FileEntry_t **parent, char **name);
+static FileEntry_t *findSlot(Volume_t *volume, FileEntry_t *directory, const uint8_t *short_name, uint64_t *offset);
+static FileEntry_t *newSlot(Volume_t *volume, FileEntry_t *directory, uint64_t *offset);
+static void putFile(const char *source, char *target);
+static void deleteLongName(Volume_t *volume, FileEntry_t *directory, FileEntry_t *entry);
+static void removeEntry(char *path);
+static void makeDirectory(char *path);
+static void truncateFile(char *path, uint32_t size);
+static void refreshEntryTable(Volume_t *volume);
+static const char *changesTarget(Volume_t *volume);
+static void overlayCommand(char *action, char *argument);
+static int compareStrings(const void *a, const void *b);
+static bool mkimageScan(struct mkimage_t *image, uint32_t directory, uint32_t depth);
+static void mkimageAlias(struct mkimage_t *image, uint32_t first, uint32_t index, const char *name);
+static bool mkimagePlan(struct mkimage_t *image, BootSector_t *BS);
+static void mkimageDirectory(struct mkimage_t *image, uint32_t directory, FileEntry_t *entries);
+static bool mkimageFill(struct mkimage_t *image, uint32_t window, uint8_t *buffer);
+static void *mkimageWorker(void *argument);
+static void collectDiffEntry(FileEntry_t *entry, const char *path, uint32_t depth, void *context);
+static int compareDiffEntries(const void *a, const void *b);
+static bool rangeDirty(Volume_t *volume, uint64_t offset, uint64_t size);
+static int compareContents(Volume_t *left, FileEntry_t *a, Volume_t *right, FileEntry_t *b, bool shared);
+static void *diffWorker(void *argument);
+static void *diffWalkWorker(void *argument);
+static void runDiffWorkers(void *(*worker)(void *), void *jobs);
+static bool collectDiffSide(Volume_t *volume, struct diff_side_t *side, struct diff_walks_t *walks);
+static bool mergeDiffSide(struct diff_side_t *side, struct diff_side_t *subtree);
+static bool sameMetadata(FileEntry_t *a, FileEntry_t *b);
+static void describeChanges(FileEntry_t *a, FileEntry_t *b, int contents);
+static void diffImages(const char *other);
+static void collectBenchEntry(FileEntry_t *entry, const char *path, uint32_t depth, void *context);
+static double benchContents(struct bench_t *bench, uint32_t iterations);
+static void runBenchmark(uint32_t iterations);
+static uint32_t fatTimestamp(uint16_t date, uint16_t time);
+static void formatTimestamp(uint32_t timestamp, char *buffer, size_t size);
+static bool tableGrow(struct entry_table_t *table);
+static bool tableAddDirectory(Volume_t *volume, FileEntry_t *directory, int32_t parent, uint32_t depth);
+static bool buildEntryTable(Volume_t *volume);
+static void freeEntryTable(struct entry_table_t *table);
+static size_t tablePath(struct entry_table_t *table, uint32_t row, char *buffer, size_t size);
+static int32_t tableLookup(struct entry_table_t *table, const char *path);
+static void scanColumn(const uint32_t *column, uint8_t *mask, uint32_t first, uint32_t last, enum find_operator operator, uint32_t value);
+static const char *parseOperator(const char *argument, enum find_operator *operator, enum find_operator fallback);
+static bool parseSize(const char *argument, uint32_t *size);
+static bool parseTimestamp(const char *argument, uint32_t *timestamp);
+static uint32_t *sortColumn(struct entry_table_t *table, const char *field);
+static int compareRows(const void *a, const void *b, void *context);
+static uint32_t *runQuery(Volume_t *volume, char **arguments, int count, uint32_t *matches, char *error, size_t error_size);
+static void findEntries(char **arguments, int count);
 
 // API
 
+void setLoadOptions(struct load_options_t options);
 int loadDiskImage(const char *name);
+Volume_t *volumeOpen(const char *name, struct load_options_t options);
+int makeImage(const char *directory, const char *output);
+void volumeClose(Volume_t *volume);
+int32_t volumeLookup(Volume_t *volume, const char *path);
+size_t volumePath(Volume_t *volume, uint32_t row, char *buffer, size_t size);
+uint32_t *volumeFind(Volume_t *volume, char **arguments, int count, uint32_t *matches, char *error, size_t error_size);
+struct extent_t *volumeExtents(Volume_t *volume, uint32_t row, uint32_t offset, uint32_t length, uint32_t *count);
+void volumeUsage(Volume_t *volume, struct usage_t *usage);
 void initGUI(void);
 void freeResources(void);
 File_t *fileOpen(char *filename);
 File_t *directoryOpen(char *directoryname);
+File_t *fileOpenAt(File_t *parent, const char *path);
+File_t *fileOpenEntry(const FileEntry_t *entry);
+int32_t fileReadDirectoryEntry(File_t *handle, FileEntry_t *entry);
 void fileClose(File_t *handle);
 int32_t fileRead(char *buffer, size_t size, size_t items, File_t *handle);
 int32_t fileReadDirectory(char *buffer, File_t *handle);
@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include "image.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+Image_t *imageOpen(const char *name) {
+  // opens a raw, gzip or zstd compressed disk image
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  Image_t *image = calloc(1, sizeof(Image_t));
+  if (image == NULL) {
+    close(fd);
+    return NULL;
+  }
+  image->fd = fd;
+  image->overlayFd = -1;
+  image->format = detectFormat(fd);
+  int result = 0;
+  if (image->format == image_raw) {
+    off_t size = lseek(fd, 0, SEEK_END);
+    result = size < 0 ? 1 : 0;
+    image->size = size;
+  } else if (image->format == image_gzip) {
+    result = gzipBuildIndex(image);
+  } else {
+    result = zstdBuildIndex(image);
+  }
+  if (result != 0) {
+    imageClose(image);
+    return NULL;
+  }
+  return image;
+}
+
+const char *imageFormatName(Image_t *image) {
+  const char *names[] = {"raw", "gzip", "zstd"};
+  return names[image->format];
+}
+
+void imageClose(Image_t *image) {
+  if (image == NULL) {
+    return;
+  }
+  for (int i = 0; i < IMAGE_CACHE_BLOCKS; i++) {
+    free(image->cache[i].data);
+  }
+  if (image->inflater != NULL) {
+    inflateEnd(image->inflater);
+    free(image->inflater);
+  }
+  free(image->inflaterInput);
+  free(image->checkpoints);
+  free(image->frames);
+  if (image->mapping != NULL) {
+    munmap(image->mapping, image->mappingSize);
+  }
+#ifdef HAVE_ZSTD
+  ZSTD_freeDCtx(image->dctx);
+#endif
+  if (image->overlayFd >= 0) {
+    close(image->overlayFd);
+  }
+  free(image->overlayMap);
+  close(image->fd);
+  free(image);
+}
+
+int64_t imageRead(Image_t *image, void *buffer, size_t size, uint64_t offset) {
+  // returns bytes read (less than size only past the end of the image) or -1 on error
+  if (offset >= image->size) {
+    return 0;
+  }
+  if (size > image->size - offset) {
+    size = image->size - offset;
+  }
+  if (image->format == image_raw && image->overlayFd >= 0) {
+    return overlayRead(image, buffer, size, offset) ? (int64_t)size : -1;
+  }
+  if (image->format == image_raw) {
+    return rawRead(image->fd, buffer, size, offset) ? (int64_t)size : -1;
+  }
+  uint8_t *output = buffer;
+  size_t done = 0;
+  while (done < size) {
+    uint64_t position = offset + done;
+    uint64_t block_start;
+    CacheBlock_t *block;
+    if (image->format == image_gzip) {
+      uint64_t id = position / IMAGE_BLOCK_SIZE;
+      block_start = id * IMAGE_BLOCK_SIZE;
+      block = cacheLookup(image, id);
+      if (block == NULL) {
+        block = gzipFetch(image, id);
+      }
+    } else {
+      // last frame starting at or before position
+      uint32_t low = 0, high = image->frameCount;
+      while (high - low > 1) {
+        uint32_t middle = (low + high) / 2;
+        if (image->frames[middle].out <= position) {
+          low = middle;
+        } else {
+          high = middle;
+        }
+      }
+      block_start = image->frames[low].out;
+      block = cacheLookup(image, low);
+      if (block == NULL) {
+        block = zstdFetch(image, low);
+      }
+    }
+    if (block == NULL || position - block_start >= block->length) {
+      return -1;
+    }
+    uint32_t within = position - block_start;
+    uint32_t to_copy = MIN(block->length - within, size - done);
+    memcpy(output + done, block->data + within, to_copy);
+    block->stamp = ++image->clock;
+    done += to_copy;
+  }
+  return done;
+}
+
+int imageOverlayOpen(Image_t *image, const char *name) {
+  // opens the overlay of a raw image, creating an empty one if the file is new or empty.
+  // a new overlay is a header and a hole the size of the image, nothing is copied
+  if (image->format != image_raw || sameFile(image->fd, name)) {
+    return 1;
+  }
+  int fd = open(name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return 1;
+  }
+  struct _OverlayHeader header;
+  uint32_t blocks = (image->size + OVERLAY_BLOCK_SIZE - 1) / OVERLAY_BLOCK_SIZE;
+  uint32_t map_size = (blocks + 7) / 8;
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return 1;
+  }
+  if (info.st_size == 0) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+    header.imageSize = image->size;
+    header.blockSize = OVERLAY_BLOCK_SIZE;
+    header.blockCount = blocks;
+    header.dataOffset = (sizeof(header) + map_size + OVERLAY_ALIGNMENT - 1) / OVERLAY_ALIGNMENT * OVERLAY_ALIGNMENT;
+    header.imageChecksum = imageChecksum(image);
+    // the bitmap starts out as part of the hole, so it reads as zeros
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(fd, header.dataOffset + image->size) != 0) {
+      close(fd);
+      return 1;
+    }
+  } else if (!rawRead(fd, &header, sizeof(header), 0)) {
+    close(fd);
+    return 1;
+  }
+  bool valid = memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) == 0 && header.imageSize == image->size;
+  valid = valid && header.blockSize == OVERLAY_BLOCK_SIZE && header.blockCount == blocks && header.imageChecksum == imageChecksum(image);
+  uint8_t *map = valid ? calloc(map_size, sizeof(uint8_t)) : NULL;
+  if (map == NULL || !rawRead(fd, map, map_size, sizeof(header))) {
+    free(map);
+    close(fd);
+    return 1;
+  }
+  image->overlayFd = fd;
+  image->overlayMap = map;
+  image->overlayBlocks = blocks;
+  image->overlayData = header.dataOffset;
+  image->overlayUsed = 0;
+  for (uint32_t i = 0; i < map_size; i++) {
+    image->overlayUsed += __builtin_popcount(map[i]);
+  }
+  return 0;
+}
+
+bool imageOverlayWrite(Image_t *image, const struct iovec *vectors, int count, uint64_t offset) {
+  // writes whole blocks, offset and the total length have to be multiples of the block size
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += vectors[i].iov_len;
+  }
+  if (offset % OVERLAY_BLOCK_SIZE != 0 || total % OVERLAY_BLOCK_SIZE != 0 || offset + total > image->size) {
+    return false;
+  }
+  if (pwritev(image->overlayFd, vectors, count, image->overlayData + offset) != (ssize_t)total) {
+    return false;
+  }
+  for (uint64_t block = offset / OVERLAY_BLOCK_SIZE; block < (offset + total) / OVERLAY_BLOCK_SIZE; block++) {
+    uint8_t bit = 1 << (block % 8);
+    image->overlayUsed += !(image->overlayMap[block / 8] & bit);
+    image->overlayMap[block / 8] |= bit;
+  }
+  return true;
+}
+
+bool imageOverlaySync(Image_t *image) {
+  // the blocks have to be on disk before the bitmap says the overlay holds them
+  uint32_t map_size = (image->overlayBlocks + 7) / 8;
+  if (fdatasync(image->overlayFd) != 0) {
+    return false;
+  }
+  if (pwrite(image->overlayFd, image->overlayMap, map_size, sizeof(struct _OverlayHeader)) != (ssize_t)map_size) {
+    return false;
+  }
+  return fdatasync(image->overlayFd) == 0;
+}
+
+int imageOverlayCommit(Image_t *image, const char *output) {
+  // writes the image as the overlay sees it to a new file, the image and the overlay stay as they are
+  if (image->overlayFd < 0 || sameFile(image->fd, output) || sameFile(image->overlayFd, output)) {
+    return 1;
+  }
+  int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return 1;
+  }
+  uint8_t *buffer = malloc(OVERLAY_COPY_SIZE);
+  bool success = buffer != NULL;
+  // the kernel copies the image on its own (sharing the extents where the filesystem can),
+  // then the blocks the overlay holds are written over it
+  loff_t in = 0, out = 0;
+  while (success && (uint64_t)in < image->size) {
+    ssize_t copied = copy_file_range(image->fd, &in, fd, &out, image->size - in, 0);
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied <= 0) {
+      // not supported here, copy through the buffer
+      size_t length = MIN(OVERLAY_COPY_SIZE, image->size - in);
+      success = rawRead(image->fd, buffer, length, in) && pwrite(fd, buffer, length, out) == (ssize_t)length;
+      in += length;
+      out += length;
+    }
+  }
+  uint64_t block = 0;
+  while (success && block < image->overlayBlocks) {
+    if (!overlayHolds(image, block)) {
+      block++;
+      continue;
+    }
+    uint64_t first = block;
+    while (block < image->overlayBlocks && overlayHolds(image, block) && (block - first) * OVERLAY_BLOCK_SIZE < OVERLAY_COPY_SIZE) {
+      block++;
+    }
+    uint64_t offset = first * OVERLAY_BLOCK_SIZE;
+    size_t length = MIN(block * OVERLAY_BLOCK_SIZE, image->size) - offset;
+    success = rawRead(image->overlayFd, buffer, length, image->overlayData + offset) && pwrite(fd, buffer, length, offset) == (ssize_t)length;
+  }
+  free(buffer);
+  success = success && fdatasync(fd) == 0;
+  close(fd);
+  return success ? 0 : 1;
+}
+
+bool imageOverlayDiscard(Image_t *image) {
+  // forgets every block and gives their space back by cutting the overlay down to its header
+  uint64_t size = image->overlayData + image->size;
+  memset(image->overlayMap, 0, (image->overlayBlocks + 7) / 8);
+  image->overlayUsed = 0;
+  if (ftruncate(image->overlayFd, image->overlayData) != 0 || ftruncate(image->overlayFd, size) != 0) {
+    return false;
+  }
+  return imageOverlaySync(image);
+}
+
+static bool overlayHolds(Image_t *image, uint64_t block) {
+  return block < image->overlayBlocks && (image->overlayMap[block / 8] & (1 << (block % 8)));
+}
+
+static bool overlayRead(Image_t *image, uint8_t *buffer, size_t size, uint64_t offset) {
+  // every run of blocks is read from the overlay if it holds them, from the image otherwise
+  while (size > 0) {
+    uint64_t block = offset / OVERLAY_BLOCK_SIZE;
+    bool held = overlayHolds(image, block);
+    uint64_t end = (block + 1) * OVERLAY_BLOCK_SIZE;
+    while (end < offset + size && overlayHolds(image, end / OVERLAY_BLOCK_SIZE) == held) {
+      end += OVERLAY_BLOCK_SIZE;
+    }
+    size_t length = MIN(end, offset + size) - offset;
+    bool success = held ? rawRead(image->overlayFd, buffer, length, image->overlayData + offset) : rawRead(image->fd, buffer, length, offset);
+    if (!success) {
+      return false;
+    }
+    buffer += length;
+    offset += length;
+    size -= length;
+  }
+  return true;
+}
+
+static uint32_t imageChecksum(Image_t *image) {
+  uint8_t *start = malloc(OVERLAY_CHECKED_SIZE);
+  if (start == NULL) {
+    return 0;
+  }
+  size_t size = MIN(OVERLAY_CHECKED_SIZE, image->size);
+  uint32_t checksum = rawRead(image->fd, start, size, 0) ? crc32(0, start, size) : 0;
+  free(start);
+  return checksum;
+}
+
+static bool sameFile(int fd, const char *name) {
+  // whether name is the file already open as fd
+  struct stat open_file, named;
+  if (fstat(fd, &open_file) != 0 || stat(name, &named) != 0) {
+    return false;
+  }
+  return open_file.st_dev == named.st_dev && open_file.st_ino == named.st_ino;
+}
+
+static enum image_format detectFormat(int fd) {
+  uint8_t magic[4] = {0};
+  if (!rawRead(fd, magic, sizeof(magic), 0)) {
+    return image_raw;
+  }
+  if (magic[0] == 0x1f && magic[1] == 0x8b) {
+    return image_gzip;
+  }
+  uint32_t value;
+  memcpy(&value, magic, sizeof(value));
+  if (value == 0xfd2fb528 || (value & 0xfffffff0) == 0x184d2a50) {
+    return image_zstd;
+  }
+  return image_raw;
+}
+
+static bool rawRead(int fd, void *buffer, size_t size, uint64_t offset) {
+  uint8_t *output = buffer;
+  while (size > 0) {
+    ssize_t result = pread(fd, output, size, offset);
+    if (result <= 0) {
+      return false;
+    }
+    output += result;
+    offset += result;
+    size -= result;
+  }
+  return true;
+}
+
+static CacheBlock_t *cacheLookup(Image_t *image, uint64_t id) {
+  for (int i = 0; i < IMAGE_CACHE_BLOCKS; i++) {
+    CacheBlock_t *block = &image->cache[i];
+    if (block->valid && block->id == id) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+static CacheBlock_t *cacheInsert(Image_t *image, uint64_t id, uint32_t length) {
+  // reuses the block's slot if it's already cached, otherwise evicts the least recently used one
+  CacheBlock_t *victim = cacheLookup(image, id);
+  for (int i = 0; victim == NULL && i < IMAGE_CACHE_BLOCKS; i++) {
+    if (!image->cache[i].valid) {
+      victim = &image->cache[i];
+    }
+  }
+  if (victim == NULL) {
+    victim = &image->cache[0];
+    for (int i = 1; i < IMAGE_CACHE_BLOCKS; i++) {
+      if (image->cache[i].stamp < victim->stamp) {
+        victim = &image->cache[i];
+      }
+    }
+  }
+  if (victim->capacity < length) {
+    uint8_t *data = realloc(victim->data, length);
+    if (data == NULL) {
+      victim->valid = false;
+      return NULL;
+    }
+    victim->data = data;
+    victim->capacity = length;
+  }
+  victim->id = id;
+  victim->length = length;
+  victim->stamp = ++image->clock;
+  victim->valid = true;
+  return victim;
+}
+
+static int gzipBuildIndex(Image_t *image) {
+  // decompresses the whole stream once, remembering the inflater state every GZIP_SPAN bytes
+  // so that any block can later be decompressed starting from the nearest checkpoint
+  z_stream strm = {0};
+  if (inflateInit2(&strm, 47) != Z_OK) {
+    return 1;
+  }
+  uint8_t *input = malloc(GZIP_CHUNK);
+  uint8_t *window = malloc(GZIP_WINDOW);
+  if (input == NULL || window == NULL) {
+    free(input);
+    free(window);
+    inflateEnd(&strm);
+    return 1;
+  }
+  uint64_t total_in = 0, total_out = 0, last = 0, read_offset = 0;
+  uint32_t capacity = 0;
+  int ret = Z_OK;
+  strm.avail_out = 0;
+  do {
+    ssize_t got = pread(image->fd, input, GZIP_CHUNK, read_offset);
+    if (got <= 0) {
+      ret = Z_DATA_ERROR;
+      break;
+    }
+    read_offset += got;
+    strm.avail_in = got;
+    strm.next_in = input;
+    do {
+      if (strm.avail_out == 0) {
+        strm.avail_out = GZIP_WINDOW;
+        strm.next_out = window;
+      }
+      total_in += strm.avail_in;
+      total_out += strm.avail_out;
+      ret = inflate(&strm, Z_BLOCK);
+      total_in -= strm.avail_in;
+      total_out -= strm.avail_out;
+      if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+        ret = Z_DATA_ERROR;
+        break;
+      }
+      if (ret == Z_STREAM_END) {
+        break;
+      }
+      // at the end of a deflate block, but not the last one
+      if ((strm.data_type & 128) && !(strm.data_type & 64) && (total_out == 0 || total_out - last > GZIP_SPAN)) {
+        if (image->checkpointCount == capacity) {
+          capacity = capacity ? capacity * 2 : 8;
+          void *grown = realloc(image->checkpoints, capacity * sizeof(struct _GzipCheckpoint));
+          if (grown == NULL) {
+            ret = Z_MEM_ERROR;
+            break;
+          }
+          image->checkpoints = grown;
+        }
+        struct _GzipCheckpoint *point = &image->checkpoints[image->checkpointCount++];
+        uint32_t left = strm.avail_out;
+        point->bits = strm.data_type & 7;
+        point->in = total_in;
+        point->out = total_out;
+        if (left) {
+          memcpy(point->window, window + GZIP_WINDOW - left, left);
+        }
+        if (left < GZIP_WINDOW) {
+          memcpy(point->window + left, window, GZIP_WINDOW - left);
+        }
+        last = total_out;
+      }
+    } while (strm.avail_in != 0);
+  } while (ret == Z_OK || ret == Z_BUF_ERROR);
+  inflateEnd(&strm);
+  free(input);
+  free(window);
+  if (ret != Z_STREAM_END || image->checkpointCount == 0) {
+    return 1;
+  }
+  image->size = total_out;
+  image->inflater = calloc(1, sizeof(z_stream));
+  image->inflaterInput = malloc(GZIP_CHUNK);
+  if (image->inflater == NULL || image->inflaterInput == NULL || inflateInit2(image->inflater, -15) != Z_OK) {
+    free(image->inflater);
+    image->inflater = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static int gzipReset(Image_t *image, uint64_t offset) {
+  // positions the inflater at the last checkpoint before offset
+  struct _GzipCheckpoint *point = image->checkpoints;
+  for (uint32_t i = 1; i < image->checkpointCount && image->checkpoints[i].out <= offset; i++) {
+    point = &image->checkpoints[i];
+  }
+  z_stream *strm = image->inflater;
+  if (inflateReset(strm) != Z_OK) {
+    return 1;
+  }
+  strm->avail_in = 0;
+  if (point->bits) {
+    uint8_t byte;
+    if (!rawRead(image->fd, &byte, 1, point->in - 1)) {
+      return 1;
+    }
+    inflatePrime(strm, point->bits, byte >> (8 - point->bits));
+  }
+  inflateSetDictionary(strm, point->window, GZIP_WINDOW);
+  image->inflaterIn = point->in;
+  image->inflaterOut = point->out;
+  return 0;
+}
+
+static int gzipInflate(Image_t *image, uint8_t *output, uint32_t length) {
+  // continues decompression from the current inflater position, returns bytes produced or -1
+  z_stream *strm = image->inflater;
+  strm->next_out = output;
+  strm->avail_out = length;
+  while (strm->avail_out != 0) {
+    if (strm->avail_in == 0) {
+      ssize_t got = pread(image->fd, image->inflaterInput, GZIP_CHUNK, image->inflaterIn);
+      if (got <= 0) {
+        return -1;
+      }
+      image->inflaterIn += got;
+      strm->next_in = image->inflaterInput;
+      strm->avail_in = got;
+    }
+    int ret = inflate(strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      break;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return -1;
+    }
+  }
+  uint32_t produced = length - strm->avail_out;
+  image->inflaterOut += produced;
+  return produced;
+}
+
+static CacheBlock_t *gzipFetch(Image_t *image, uint64_t block) {
+  // decompresses up to and including the block, caching every whole block on the way
+  uint64_t start = block * IMAGE_BLOCK_SIZE;
+  uint64_t checkpoint = image->checkpoints[0].out;
+  for (uint32_t i = 1; i < image->checkpointCount && image->checkpoints[i].out <= start; i++) {
+    checkpoint = image->checkpoints[i].out;
+  }
+  if (image->inflaterOut > start || image->inflaterOut < checkpoint || image->inflaterOut == 0) {
+    if (gzipReset(image, start) != 0) {
+      return NULL;
+    }
+  }
+  uint8_t *discard = NULL;
+  while (true) {
+    uint64_t position = image->inflaterOut;
+    uint64_t id = position / IMAGE_BLOCK_SIZE;
+    uint32_t within = position % IMAGE_BLOCK_SIZE;
+    uint32_t length = MIN(IMAGE_BLOCK_SIZE, image->size - id * IMAGE_BLOCK_SIZE);
+    if (within != 0) {
+      // checkpoints aren't block aligned, skip to the next block boundary
+      if (discard == NULL && (discard = malloc(IMAGE_BLOCK_SIZE)) == NULL) {
+        return NULL;
+      }
+      if (gzipInflate(image, discard, length - within) != length - within) {
+        free(discard);
+        return NULL;
+      }
+      continue;
+    }
+    CacheBlock_t *cached = cacheInsert(image, id, length);
+    if (cached == NULL || gzipInflate(image, cached->data, length) != length) {
+      if (cached != NULL) {
+        cached->valid = false;
+      }
+      free(discard);
+      return NULL;
+    }
+    if (id == block) {
+      free(discard);
+      return cached;
+    }
+  }
+}
+
+#ifdef HAVE_ZSTD
+
+static int zstdAddFrame(Image_t *image, uint32_t *capacity, uint64_t in, uint64_t out, uint64_t compressed_size, uint64_t size) {
+  if (compressed_size > UINT32_MAX || size > UINT32_MAX) {
+    return 1;
+  }
+  if (image->frameCount == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(image->frames, *capacity * sizeof(struct _ZstdFrame));
+    if (grown == NULL) {
+      return 1;
+    }
+    image->frames = grown;
+  }
+  struct _ZstdFrame *frame = &image->frames[image->frameCount++];
+  frame->in = in;
+  frame->out = out;
+  frame->compressed_size = compressed_size;
+  frame->size = size;
+  return 0;
+}
+
+static bool zstdSeekTable(Image_t *image, uint32_t *capacity) {
+  // reads the seek table of the seekable format, if the file has one
+  uint8_t *map = image->mapping;
+  uint64_t size = image->mappingSize;
+  if (size < ZSTD_FOOTER_SIZE + 8) {
+    return false;
+  }
+  uint32_t frames, magic;
+  uint8_t descriptor = map[size - 5];
+  memcpy(&frames, map + size - ZSTD_FOOTER_SIZE, sizeof(frames));
+  memcpy(&magic, map + size - 4, sizeof(magic));
+  if (magic != ZSTD_SEEKABLE_MAGIC) {
+    return false;
+  }
+  uint32_t entry_size = (descriptor & 0x80) ? 12 : 8;
+  uint64_t table_size = (uint64_t)frames * entry_size + ZSTD_FOOTER_SIZE;
+  if (table_size + 8 > size) {
+    return false;
+  }
+  uint8_t *entries = map + size - table_size;
+  uint32_t skippable;
+  memcpy(&skippable, entries - 8, sizeof(skippable));
+  if (skippable != 0x184d2a5e) {
+    return false;
+  }
+  uint64_t in = 0, out = 0;
+  for (uint32_t i = 0; i < frames; i++) {
+    uint32_t compressed_size, decompressed_size;
+    memcpy(&compressed_size, entries + i * entry_size, sizeof(compressed_size));
+    memcpy(&decompressed_size, entries + i * entry_size + 4, sizeof(decompressed_size));
+    if (zstdAddFrame(image, capacity, in, out, compressed_size, decompressed_size) != 0) {
+      return false;
+    }
+    in += compressed_size;
+    out += decompressed_size;
+  }
+  image->size = out;
+  return in + table_size + 8 <= size;
+}
+
+static int zstdBuildIndex(Image_t *image) {
+  // uses the seek table when present, otherwise walks the frame headers once
+  off_t size = lseek(image->fd, 0, SEEK_END);
+  if (size <= 0) {
+    return 1;
+  }
+  image->mappingSize = size;
+  image->mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, image->fd, 0);
+  if (image->mapping == MAP_FAILED) {
+    image->mapping = NULL;
+    return 1;
+  }
+  image->dctx = ZSTD_createDCtx();
+  if (image->dctx == NULL) {
+    return 1;
+  }
+  uint32_t capacity = 0;
+  if (zstdSeekTable(image, &capacity)) {
+    return image->frameCount == 0;
+  }
+  image->frameCount = 0;
+  uint64_t in = 0, out = 0;
+  while (in < (uint64_t)size) {
+    uint8_t *frame = image->mapping + in;
+    size_t remaining = size - in;
+    size_t compressed_size = ZSTD_findFrameCompressedSize(frame, remaining);
+    if (ZSTD_isError(compressed_size)) {
+      return 1;
+    }
+    uint32_t magic = 0;
+    memcpy(&magic, frame, MIN(sizeof(magic), remaining));
+    if ((magic & 0xfffffff0) != 0x184d2a50) {
+      unsigned long long content_size = ZSTD_getFrameContentSize(frame, remaining);
+      if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR) {
+        printf("zstd frames without a content size can't be read randomly\n");
+        return 1;
+      }
+      if (zstdAddFrame(image, &capacity, in, out, compressed_size, content_size) != 0) {
+        return 1;
+      }
+      out += content_size;
+    }
+    in += compressed_size;
+  }
+  image->size = out;
+  return image->frameCount == 0;
+}
+
+static CacheBlock_t *zstdFetch(Image_t *image, uint32_t index) {
+  struct _ZstdFrame *frame = &image->frames[index];
+  CacheBlock_t *cached = cacheInsert(image, index, frame->size);
+  if (cached == NULL) {
+    return NULL;
+  }
+  size_t result = ZSTD_decompressDCtx(image->dctx, cached->data, frame->size, image->mapping + frame->in, frame->compressed_size);
+  if (ZSTD_isError(result) || result != frame->size) {
+    cached->valid = false;
+    return NULL;
+  }
+  return cached;
+}
+
+#else
+
+static int zstdBuildIndex(Image_t *image) {
+  printf("fatview was built without zstd support (make ZSTD=1)\n");
+  return 1;
+}
+
+static CacheBlock_t *zstdFetch(Image_t *image, uint32_t frame) {
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef __IMAGE_
+#define __IMAGE_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+// compressed images are decompressed in blocks which are kept in a small cache
+#define IMAGE_BLOCK_SIZE (64 * 1024)
+#define IMAGE_CACHE_BLOCKS 64
+
+// distance (in uncompressed bytes) between gzip checkpoints
+#define GZIP_SPAN (1024 * 1024)
+#define GZIP_WINDOW 32768
+#define GZIP_CHUNK 16384
+
+#define ZSTD_SEEKABLE_MAGIC 0x8f92eab1
+#define ZSTD_FOOTER_SIZE 9
+
+// changes to a raw image can go to an overlay file instead, a header and a bitmap of the blocks it holds
+// followed by a sparse copy of the image where only those blocks are ever written
+#define OVERLAY_MAGIC "FATVOVL1"
+#define OVERLAY_BLOCK_SIZE 512 // the smallest sector size, so sector writes never share a block
+#define OVERLAY_ALIGNMENT 4096
+#define OVERLAY_COPY_SIZE (1024 * 1024)
+#define OVERLAY_CHECKED_SIZE (64 * 1024) // start of the image an overlay is checked against
+
+enum image_format {image_raw, image_gzip, image_zstd};
+
+struct _OverlayHeader {
+  char magic[8];
+  uint64_t imageSize; // of the image the overlay was made for
+  uint32_t blockSize;
+  uint32_t blockCount;
+  uint64_t dataOffset; // where offset 0 of the image is in the overlay
+  uint32_t imageChecksum; // crc32 of the start of the image, catches overlays opened with another one
+};
+
+struct _CacheBlock {
+  uint64_t id;
+  uint64_t stamp; // last use, the lowest one gets evicted
+  uint32_t length;
+  uint32_t capacity;
+  uint8_t *data;
+  bool valid;
+};
+
+struct _GzipCheckpoint {
+  uint64_t out; // offset in the uncompressed stream
+  uint64_t in; // offset of the first full byte in the compressed stream
+  int bits; // bits of the preceding byte that belong to this block (0-7)
+  uint8_t window[GZIP_WINDOW];
+};
+
+struct _ZstdFrame {
+  uint64_t in; // offset of the frame in the compressed file
+  uint64_t out; // offset of the frame's contents in the image
+  uint32_t compressed_size;
+  uint32_t size;
+};
+
+struct _Image_t {
+  enum image_format format;
+  int fd;
+  uint64_t size; // uncompressed size
+  uint64_t clock;
+  struct _CacheBlock cache[IMAGE_CACHE_BLOCKS];
+  // gzip
+  struct _GzipCheckpoint *checkpoints;
+  uint32_t checkpointCount;
+  void *inflater; // z_stream kept alive between reads so sequential access doesn't restart
+  uint64_t inflaterIn;
+  uint64_t inflaterOut;
+  uint8_t *inflaterInput;
+  // zstd
+  struct _ZstdFrame *frames;
+  uint32_t frameCount;
+  uint8_t *mapping;
+  uint64_t mappingSize;
+  void *dctx;
+  // overlay, overlayFd is -1 without one
+  int overlayFd;
+  uint8_t *overlayMap; // one bit per block the overlay holds
+  uint32_t overlayBlocks;
+  uint32_t overlayUsed; // blocks held
+  uint64_t overlayData;
+};
+
+typedef struct _Image_t Image_t;
+typedef struct _CacheBlock CacheBlock_t;
+
+// internal functions
+
+static enum image_format detectFormat(int fd);
+static bool rawRead(int fd, void *buffer, size_t size, uint64_t offset);
+static CacheBlock_t *cacheLookup(Image_t *image, uint64_t id);
+static CacheBlock_t *cacheInsert(Image_t *image, uint64_t id, uint32_t length);
+static int gzipBuildIndex(Image_t *image);
+static int gzipReset(Image_t *image, uint64_t offset);
+static int gzipInflate(Image_t *image, uint8_t *output, uint32_t length);
+static CacheBlock_t *gzipFetch(Image_t *image, uint64_t block);
+static int zstdBuildIndex(Image_t *image);
+static CacheBlock_t *zstdFetch(Image_t *image, uint32_t frame);
+static bool overlayHolds(Image_t *image, uint64_t block);
+static bool overlayRead(Image_t *image, uint8_t *buffer, size_t size, uint64_t offset);
+static bool sameFile(int fd, const char *name);
+static uint32_t imageChecksum(Image_t *image);
+
+// API
+
+Image_t *imageOpen(const char *name);
+int64_t imageRead(Image_t *image, void *buffer, size_t size, uint64_t offset);
+const char *imageFormatName(Image_t *image);
+void imageClose(Image_t *image);
+int imageOverlayOpen(Image_t *image, const char *name);
+bool imageOverlayWrite(Image_t *image, const struct iovec *vectors, int count, uint64_t offset);
+bool imageOverlaySync(Image_t *image);
+int imageOverlayCommit(Image_t *image, const char *output);
+bool imageOverlayDiscard(Image_t *image);
+
+#endif // __IMAGE_
@@ -0,0 +1,242 @@
+#include "inventory.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+int inventoryRun(const char *source, bool files, struct load_options_t options) {
+  // writes one JSON object per image to stdout: boot sector, cluster usage and entry counts,
+  // plus every path with files set; images come from a directory or a list file, "-" reads the list from stdin
+  Inventory_t inventory;
+  memset(&inventory, 0, sizeof(inventory));
+  inventory.files = files;
+  inventory.options = options;
+  // only the FAT and the directories are read, file contents never are
+  inventory.options.lazy = true;
+  inventory.options.overlay = NULL;
+  struct stat info;
+  bool collected;
+  if (strcmp(source, "-") != 0 && stat(source, &info) == 0 && S_ISDIR(info.st_mode)) {
+    collected = collectDirectory(&inventory, source);
+  } else {
+    collected = collectList(&inventory, source);
+  }
+  int status = 1;
+  int fd = -1;
+  if (!collected) {
+    goto cleanup;
+  }
+  // the records own stdout, messages printed while opening images go to stderr instead
+  fflush(stdout);
+  fd = dup(STDOUT_FILENO);
+  if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+    printf("Couldn't redirect stdout: %s\n", strerror(errno));
+    goto cleanup;
+  }
+  inventory.output = outputOpen(fd);
+  if (inventory.output == NULL) {
+    printf("Couldn't allocate memory\n");
+    goto cleanup;
+  }
+  pthread_mutex_init(&inventory.lock, NULL);
+  pthread_t threads[INVENTORY_THREADS];
+  uint32_t started = 0;
+  for (; started < MIN(INVENTORY_THREADS, inventory.count); started++) {
+    if (pthread_create(&threads[started], NULL, inventoryWorker, &inventory) != 0) {
+      break;
+    }
+  }
+  if (started == 0 && inventory.count > 0) {
+    // no threads, do the work here
+    inventoryWorker(&inventory);
+  }
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&inventory.lock);
+  bool written = outputClose(inventory.output);
+  status = written && inventory.failed == 0 ? 0 : 1;
+  printf("%u %s, %u couldn't be read\n", inventory.count, inventory.count == 1 ? "image" : "images", inventory.failed);
+
+cleanup:
+  if (fd >= 0) {
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+  for (uint32_t i = 0; i < inventory.count; i++) {
+    free(inventory.images[i]);
+  }
+  free(inventory.images);
+  return status;
+}
+
+static bool addImage(Inventory_t *inventory, const char *path) {
+  if (inventory->count == inventory->capacity) {
+    uint32_t capacity = inventory->capacity ? inventory->capacity * 2 : 64;
+    char **images = realloc(inventory->images, capacity * sizeof(char *));
+    if (images == NULL) {
+      return false;
+    }
+    inventory->images = images;
+    inventory->capacity = capacity;
+  }
+  inventory->images[inventory->count] = strdup(path);
+  if (inventory->images[inventory->count] == NULL) {
+    return false;
+  }
+  inventory->count++;
+  return true;
+}
+
+static int compareImages(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool collectDirectory(Inventory_t *inventory, const char *directory) {
+  // every regular file directly inside the directory, sorted so runs hand images out in the same order
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    printf("Couldn't open %s: %s\n", directory, strerror(errno));
+    return false;
+  }
+  char path[INVENTORY_LINE_SIZE];
+  struct dirent *item;
+  bool success = true;
+  while (success && (item = readdir(dir)) != NULL) {
+    if (item->d_name[0] == '.') {
+      continue;
+    }
+    struct stat info;
+    snprintf(path, sizeof(path), "%s/%s", directory, item->d_name);
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+    if (!addImage(inventory, path)) {
+      printf("Couldn't allocate memory\n");
+      success = false;
+    }
+  }
+  closedir(dir);
+  if (success) {
+    qsort(inventory->images, inventory->count, sizeof(char *), compareImages);
+  }
+  return success;
+}
+
+static bool collectList(Inventory_t *inventory, const char *list) {
+  // one path per line, blank lines are skipped
+  FILE *file = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+  if (file == NULL) {
+    printf("Couldn't open %s: %s\n", list, strerror(errno));
+    return false;
+  }
+  char line[INVENTORY_LINE_SIZE];
+  bool success = true;
+  while (success && fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+      continue;
+    }
+    if (!addImage(inventory, line)) {
+      printf("Couldn't allocate memory\n");
+      success = false;
+    }
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  return success;
+}
+
+static void *inventoryWorker(void *argument) {
+  Inventory_t *inventory = argument;
+  while (true) {
+    pthread_mutex_lock(&inventory->lock);
+    uint32_t index = inventory->next++;
+    pthread_mutex_unlock(&inventory->lock);
+    if (index >= inventory->count) {
+      break;
+    }
+    const char *image = inventory->images[index];
+    // the reading happens outside the lock, only the record is written under it
+    Volume_t *volume = volumeOpen(image, inventory->options);
+    pthread_mutex_lock(&inventory->lock);
+    if (volume != NULL) {
+      writeRecord(inventory, image, volume);
+    } else {
+      inventory->failed++;
+      outputString(inventory->output, "{\"image\":");
+      outputJSONString(inventory->output, image);
+      outputString(inventory->output, ",\"error\":\"couldn't read the image\"}\n");
+    }
+    pthread_mutex_unlock(&inventory->lock);
+    volumeClose(volume);
+  }
+  return NULL;
+}
+
+static void writeField(Output_t *output, const char *key, const uint8_t *field, size_t size) {
+  // a space padded boot sector field, anything that isn't printable ASCII becomes '?'
+  char value[16];
+  while (size > 0 && field[size - 1] == ' ') {
+    size--;
+  }
+  size = MIN(size, sizeof(value) - 1);
+  for (size_t i = 0; i < size; i++) {
+    value[i] = field[i] >= 0x20 && field[i] < 0x7f ? field[i] : '?';
+  }
+  value[size] = '\0';
+  outputFormat(output, ",\"%s\":", key);
+  outputJSONString(output, value);
+}
+
+static void writeRecord(Inventory_t *inventory, const char *image, Volume_t *volume) {
+  Output_t *output = inventory->output;
+  BootSector_t *BS = volume->BS;
+  struct geometry_t *geometry = &volume->geometry;
+  struct entry_table_t *table = &volume->table;
+  struct usage_t usage;
+  volumeUsage(volume, &usage);
+  uint32_t files = 0;
+  uint32_t directories = 0;
+  uint64_t file_bytes = 0;
+  for (uint32_t i = 0; i < table->count; i++) {
+    if (table->attributes[i] & DIRECTORY) {
+      directories++;
+    } else {
+      files++;
+      file_bytes += table->size[i];
+    }
+  }
+  outputString(output, "{\"image\":");
+  outputJSONString(output, image);
+  outputFormat(output, ",\"format\":\"%s\"", imageFormatName(volume->image));
+  writeField(output, "oem", BS->OEM, sizeof(BS->OEM));
+  outputFormat(output, ",\"bytes_per_sector\":%hu,\"sectors_per_cluster\":%hhu,\"reserved_sectors\":%hu", BS->bytes_per_sector, BS->sectors_per_cluster, BS->reserved_area);
+  outputFormat(output, ",\"fats\":%hhu,\"sectors_per_fat\":%hu,\"root_entries\":%hu,\"sectors\":%u", BS->FATs, BS->size_of_FAT, BS->max_files_in_root, geometry->sectorCount);
+  outputFormat(output, ",\"media\":%hhu,\"sectors_per_track\":%hu,\"heads\":%hu,\"hidden_sectors\":%u", BS->media_type, BS->sectors_per_track, BS->number_of_heads, BS->number_of_sectors_before_start_pos);
+  // the serial, label and type are only there with the extended boot signature
+  if (BS->ex_boot_signature == 0x29) {
+    outputFormat(output, ",\"serial\":\"%04X-%04X\"", BS->serial_number >> 16, BS->serial_number & 0xffff);
+    writeField(output, "label", BS->volume_label, sizeof(BS->volume_label));
+    writeField(output, "type", BS->system_type_level, sizeof(BS->system_type_level));
+  }
+  outputFormat(output, ",\"cluster_size\":%u,\"clusters\":%u,\"used_clusters\":%u,\"free_clusters\":%u,\"bad_clusters\":%u", geometry->clusterSize, geometry->clusterLimit - 2, usage.used, usage.free, usage.bad);
+  outputFormat(output, ",\"free_bytes\":%llu", (unsigned long long)usage.free * geometry->clusterSize);
+  outputFormat(output, ",\"files\":%u,\"directories\":%u,\"file_bytes\":%llu", files, directories, (unsigned long long)file_bytes);
+  if (inventory->files) {
+    char path[PATH_SIZE];
+    outputString(output, ",\"entries\":[");
+    for (uint32_t i = 0; i < table->count; i++) {
+      volumePath(volume, i, path, sizeof(path));
+      uint32_t modified = table->modified[i] ? table->modified[i] + UNIX_1980 : 0;
+      outputString(output, i > 0 ? ",{\"path\":" : "{\"path\":");
+      outputJSONString(output, path);
+      outputFormat(output, ",\"directory\":%s,\"size\":%u,\"modified\":%u}", table->attributes[i] & DIRECTORY ? "true" : "false", table->size[i], modified);
+    }
+    outputChar(output, ']');
+  }
+  outputString(output, "}\n");
+}
@@ -0,0 +1,38 @@
+#ifndef __INVENTORY_
+#define __INVENTORY_
+
+#include "FAT.h"
+
+// images are opened by a fixed number of workers, so memory use doesn't grow with the batch
+#define INVENTORY_THREADS 8
+#define INVENTORY_LINE_SIZE 4096
+
+struct _Inventory {
+  char **images;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t next; // next image to be picked up by a worker
+  uint32_t failed;
+  bool files; // list every file and directory of an image in its record
+  struct load_options_t options;
+  Output_t *output;
+  pthread_mutex_t lock; // guards next, failed and the output stream
+};
+
+typedef struct _Inventory Inventory_t;
+
+// internal functions
+
+static bool addImage(Inventory_t *inventory, const char *path);
+static bool collectDirectory(Inventory_t *inventory, const char *directory);
+static bool collectList(Inventory_t *inventory, const char *list);
+static int compareImages(const void *a, const void *b);
+static void *inventoryWorker(void *argument);
+static void writeField(Output_t *output, const char *key, const uint8_t *field, size_t size);
+static void writeRecord(Inventory_t *inventory, const char *image, Volume_t *volume);
+
+// API
+
+int inventoryRun(const char *source, bool files, struct load_options_t options);
+
+#endif // __INVENTORY_
@@ -1,13 +1,60 @@
 #include <stdio.h>
 #include "FAT.h"
+#include "server.h"
+#include "inventory.h"
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("usage: %s <file input>\n", argv[0]);
+  struct load_options_t options = {0};
+  const char *image = NULL;
+  const char *inventory = NULL;
+  bool files = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--serve") == 0 && i + 2 < argc) {
+      // every argument after the socket is an image to serve
+      return serverRun(argv[i + 1], argv + i + 2, argc - i - 2, options);
+    } else if (strcmp(argv[i], "--mkimage") == 0 && i + 2 < argc) {
+      return makeImage(argv[i + 1], argv[i + 2]);
+    } else if (strcmp(argv[i], "--inventory") == 0 && i + 1 < argc) {
+      inventory = argv[++i];
+    } else if (strcmp(argv[i], "--files") == 0) {
+      files = true;
+    } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+      options.overlay = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      options.lazy = true;
+    } else if (strncmp(argv[i], "--fat-policy=", 13) == 0) {
+      const char *policy = argv[i] + 13;
+      if (strcmp(policy, "primary") == 0) {
+        options.fatPolicy = fat_primary;
+      } else if (strcmp(policy, "majority") == 0) {
+        options.fatPolicy = fat_majority;
+      } else if (strcmp(policy, "fail") == 0) {
+        options.fatPolicy = fat_fail;
+      } else {
+        printf("unknown FAT policy '%s', use primary, majority or fail\n", policy);
+        return 1;
+      }
+    } else {
+      image = argv[i];
+    }
+  }
+  if (inventory != NULL) {
+    return inventoryRun(inventory, files, options);
+  }
+  if (image == NULL) {
+    printf("usage: %s [--lazy] [--json] [--fat-policy=primary|majority|fail] [--overlay <file>] <file input>\n", argv[0]);
+    printf("       %s [--fat-policy=primary|majority|fail] --serve <socket> <file input>...\n", argv[0]);
+    printf("       %s --mkimage <directory> <file output>\n", argv[0]);
+    printf("       %s [--fat-policy=primary|majority|fail] [--files] --inventory <directory|list file|->\n", argv[0]);
+    return 1;
+  }
+  setLoadOptions(options);
+  if (loadDiskImage(image) != 0) {
     return 1;
   }
-  loadDiskImage(argv[1]);
   initGUI();
   freeResources();
   return 0;
-}
\ No newline at end of file
+}
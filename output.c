@@ -0,0 +1,154 @@
+#include "output.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+Output_t *outputOpen(int fd) {
+  Output_t *output = calloc(1, sizeof(Output_t));
+  if (output == NULL) {
+    return NULL;
+  }
+  output->buffer = malloc(OUTPUT_BUFFER_SIZE);
+  if (output->buffer == NULL) {
+    free(output);
+    return NULL;
+  }
+  output->fd = fd;
+  return output;
+}
+
+static char *outputReserve(Output_t *output, size_t size) {
+  // makes room for size more bytes, size has to fit in the buffer
+  if (output->length + size > OUTPUT_BUFFER_SIZE) {
+    outputFlush(output);
+  }
+  return output->buffer + output->length;
+}
+
+void outputWrite(Output_t *output, const void *data, size_t size) {
+  if (size > OUTPUT_BUFFER_SIZE) {
+    // too big to be worth buffering
+    outputFlush(output);
+    const char *bytes = data;
+    while (size > 0 && !output->failed) {
+      ssize_t written = write(output->fd, bytes, size);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      output->failed = written <= 0;
+      bytes += written > 0 ? written : 0;
+      size -= written > 0 ? written : 0;
+    }
+    return;
+  }
+  memcpy(outputReserve(output, size), data, size);
+  output->length += size;
+}
+
+void outputString(Output_t *output, const char *string) {
+  outputWrite(output, string, strlen(string));
+}
+
+void outputChar(Output_t *output, char c) {
+  *outputReserve(output, 1) = c;
+  output->length++;
+}
+
+void outputUnsigned(Output_t *output, uint64_t value) {
+  // digits are produced backwards into a scratch buffer
+  char digits[20];
+  int count = 0;
+  do {
+    digits[sizeof(digits) - ++count] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  outputWrite(output, digits + sizeof(digits) - count, count);
+}
+
+void outputFormat(Output_t *output, const char *format, ...) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    size_t space = OUTPUT_BUFFER_SIZE - output->length;
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(output->buffer + output->length, space, format, arguments);
+    va_end(arguments);
+    if (length < 0) {
+      return;
+    }
+    if ((size_t)length < space) {
+      output->length += length;
+      return;
+    }
+    outputFlush(output);
+  }
+}
+
+static size_t utf8Length(const unsigned char *c) {
+  // length of the well-formed UTF-8 sequence at c, 0 if it isn't one (overlong, surrogate or cut short)
+  uint32_t length = *c >= 0xf0 ? 4 : *c >= 0xe0 ? 3 : *c >= 0xc2 ? 2 : 0;
+  if (length == 0 || *c > 0xf4) {
+    return 0;
+  }
+  uint32_t point = *c & (0x3f >> (length - 1));
+  for (uint32_t i = 1; i < length; i++) {
+    if ((c[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    point = point << 6 | (c[i] & 0x3f);
+  }
+  bool shortest = length == 2 || (length == 3 && point >= 0x800) || (length == 4 && point >= 0x10000);
+  return shortest && point <= 0x10ffff && (point < 0xd800 || point > 0xdfff) ? length : 0;
+}
+
+void outputJSONString(Output_t *output, const char *string) {
+  // quoted, with quotes, backslashes and control characters escaped; bytes that aren't part of
+  // valid UTF-8 (code page characters in 8.3 names) are taken as Latin-1 so the line stays valid UTF-8
+  static const char hex[] = "0123456789abcdef";
+  outputChar(output, '"');
+  for (const unsigned char *c = (const unsigned char *)string; *c; c++) {
+    size_t length = *c >= 0x80 ? utf8Length(c) : 1;
+    if (*c == '"' || *c == '\\') {
+      char *destination = outputReserve(output, 2);
+      destination[0] = '\\';
+      destination[1] = *c;
+      output->length += 2;
+    } else if (*c < 0x20 || length == 0) {
+      char *destination = outputReserve(output, 6);
+      memcpy(destination, "\\u00", 4);
+      destination[4] = hex[*c >> 4];
+      destination[5] = hex[*c & 15];
+      output->length += 6;
+    } else {
+      outputWrite(output, c, length);
+      c += length - 1;
+    }
+  }
+  outputChar(output, '"');
+}
+
+bool outputFlush(Output_t *output) {
+  size_t done = 0;
+  while (done < output->length && !output->failed) {
+    ssize_t written = write(output->fd, output->buffer + done, output->length - done);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    output->failed = written <= 0;
+    done += written > 0 ? written : 0;
+  }
+  output->length = 0;
+  return !output->failed;
+}
+
+bool outputClose(Output_t *output) {
+  if (output == NULL) {
+    return false;
+  }
+  bool success = outputFlush(output);
+  free(output->buffer);
+  free(output);
+  return success;
+}
@@ -0,0 +1,37 @@
+#ifndef __OUTPUT_
+#define __OUTPUT_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// everything is gathered in one buffer and written with a single write() once it fills up
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+struct _Output {
+  int fd;
+  size_t length;
+  bool failed;
+  char *buffer;
+};
+
+typedef struct _Output Output_t;
+
+// internal functions
+
+static char *outputReserve(Output_t *output, size_t size);
+static size_t utf8Length(const unsigned char *c);
+
+// API
+
+Output_t *outputOpen(int fd);
+void outputWrite(Output_t *output, const void *data, size_t size);
+void outputString(Output_t *output, const char *string);
+void outputChar(Output_t *output, char c);
+void outputUnsigned(Output_t *output, uint64_t value);
+void outputFormat(Output_t *output, const char *format, ...);
+void outputJSONString(Output_t *output, const char *string);
+bool outputFlush(Output_t *output);
+bool outputClose(Output_t *output);
+
+#endif // __OUTPUT_
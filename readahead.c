@@ -0,0 +1,331 @@
+#include "readahead.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+Readahead_t *readaheadCreate(int fd) {
+  // uses io_uring when the kernel allows it, otherwise a small pool of pread threads
+  Readahead_t *ra = calloc(1, sizeof(Readahead_t));
+  if (ra == NULL) {
+    return NULL;
+  }
+  ra->fd = fd;
+  ra->depth = READAHEAD_DEPTH;
+  ra->ring = -1;
+  if (uringSetup(ra) == 0) {
+    ra->backend = readahead_uring;
+    return ra;
+  }
+  if (poolSetup(ra) == 0) {
+    ra->backend = readahead_threads;
+    return ra;
+  }
+  free(ra);
+  return NULL;
+}
+
+const char *readaheadBackendName(Readahead_t *ra) {
+  return ra->backend == readahead_uring ? "io_uring" : "thread pool";
+}
+
+int readaheadSubmit(Readahead_t *ra, uint64_t offset, uint8_t *destination, uint32_t length) {
+  // queues a read, blocking only while the window of in-flight reads is full
+  if (ra->backend == readahead_uring) {
+    while (ra->inFlight == ra->depth) {
+      uringReap(ra, true);
+    }
+    uint32_t slot = freeSlot(ra);
+    ra->requests[slot] = (struct _ReadRequest){offset, destination, length, true};
+    ra->inFlight++;
+    uringSubmit(ra, slot);
+    // pick up whatever finished already, without waiting
+    uringReap(ra, false);
+    return 0;
+  }
+  pthread_mutex_lock(&ra->lock);
+  while (ra->inFlight == ra->depth) {
+    pthread_cond_wait(&ra->changed, &ra->lock);
+  }
+  uint32_t slot = freeSlot(ra);
+  ra->requests[slot] = (struct _ReadRequest){offset, destination, length, true};
+  ra->inFlight++;
+  ra->queue[(ra->queueHead + ra->queueLength) % READAHEAD_DEPTH] = slot;
+  ra->queueLength++;
+  pthread_cond_broadcast(&ra->changed);
+  pthread_mutex_unlock(&ra->lock);
+  return 0;
+}
+
+int readaheadWait(Readahead_t *ra) {
+  // waits for every submitted read, returns -1 if any of them failed
+  bool failed;
+  if (ra->backend == readahead_uring) {
+    while (ra->inFlight > 0) {
+      uringReap(ra, true);
+    }
+    failed = ra->failed;
+  } else {
+    pthread_mutex_lock(&ra->lock);
+    while (ra->inFlight > 0) {
+      pthread_cond_wait(&ra->changed, &ra->lock);
+    }
+    failed = ra->failed;
+    pthread_mutex_unlock(&ra->lock);
+  }
+  ra->failed = false;
+  return failed ? -1 : 0;
+}
+
+void readaheadDestroy(Readahead_t *ra) {
+  if (ra == NULL) {
+    return;
+  }
+  if (ra->backend == readahead_uring) {
+    munmap(ra->sqes, ra->depth * sizeof(struct io_uring_sqe));
+    if (ra->cqRing != ra->sqRing) {
+      munmap(ra->cqRing, ra->cqRingSize);
+    }
+    munmap(ra->sqRing, ra->sqRingSize);
+    close(ra->ring);
+  } else {
+    pthread_mutex_lock(&ra->lock);
+    ra->stopping = true;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+    for (int i = 0; i < READAHEAD_THREADS; i++) {
+      pthread_join(ra->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->changed);
+  }
+  free(ra);
+}
+
+static uint32_t freeSlot(Readahead_t *ra) {
+  for (uint32_t i = 0; i < ra->depth; i++) {
+    if (!ra->requests[i].busy) {
+      return i;
+    }
+  }
+  return 0; // unreachable, callers make sure a slot is free
+}
+
+static int uringSetup(Readahead_t *ra) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring = syscall(__NR_io_uring_setup, ra->depth, &params);
+  if (ring < 0) {
+    return 1;
+  }
+  if (!uringSupportsRead(ring)) {
+    // every read would fail with EINVAL, the thread pool does the work instead
+    close(ring);
+    return 1;
+  }
+  ra->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ra->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ra->cqRingSize > ra->sqRingSize) {
+    ra->sqRingSize = ra->cqRingSize;
+  }
+  ra->sqRing = mmap(NULL, ra->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+  if (ra->sqRing == MAP_FAILED) {
+    close(ring);
+    return 1;
+  }
+  ra->cqRing = ra->sqRing;
+  if (!single_mmap) {
+    ra->cqRing = mmap(NULL, ra->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    if (ra->cqRing == MAP_FAILED) {
+      munmap(ra->sqRing, ra->sqRingSize);
+      close(ring);
+      return 1;
+    }
+  }
+  ra->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+  if (ra->sqes == MAP_FAILED) {
+    if (ra->cqRing != ra->sqRing) {
+      munmap(ra->cqRing, ra->cqRingSize);
+    }
+    munmap(ra->sqRing, ra->sqRingSize);
+    close(ring);
+    return 1;
+  }
+  uint8_t *sq = ra->sqRing;
+  uint8_t *cq = ra->cqRing;
+  ra->sqHead = (uint32_t *)(sq + params.sq_off.head);
+  ra->sqTail = (uint32_t *)(sq + params.sq_off.tail);
+  ra->sqMask = (uint32_t *)(sq + params.sq_off.ring_mask);
+  ra->sqArray = (uint32_t *)(sq + params.sq_off.array);
+  ra->cqHead = (uint32_t *)(cq + params.cq_off.head);
+  ra->cqTail = (uint32_t *)(cq + params.cq_off.tail);
+  ra->cqMask = (uint32_t *)(cq + params.cq_off.ring_mask);
+  ra->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ra->ring = ring;
+  ra->depth = params.sq_entries < READAHEAD_DEPTH ? params.sq_entries : READAHEAD_DEPTH;
+  return 0;
+}
+
+static bool uringSupportsRead(int ring) {
+  // IORING_OP_READ came with the probe, a kernel that can't be probed doesn't have it either
+  size_t size = sizeof(struct io_uring_probe) + READAHEAD_PROBE_OPS * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL) {
+    return false;
+  }
+  bool supported = syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, READAHEAD_PROBE_OPS) == 0 &&
+                   probe->ops_len > IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return supported;
+}
+
+static void uringSubmit(Readahead_t *ra, uint32_t slot) {
+  // once the tail moves the kernel owns the entry, a failed enter leaves it to be submitted later
+  struct _ReadRequest *request = &ra->requests[slot];
+  uint32_t tail = *ra->sqTail;
+  uint32_t index = tail & *ra->sqMask;
+  struct io_uring_sqe *sqe = &ra->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = ra->fd;
+  sqe->addr = (uint64_t)(uintptr_t)request->destination;
+  sqe->len = request->length;
+  sqe->off = request->offset;
+  sqe->user_data = slot;
+  ra->sqArray[index] = index;
+  __atomic_store_n(ra->sqTail, tail + 1, __ATOMIC_RELEASE);
+  uringEnter(ra, 0);
+}
+
+static void uringEnter(Readahead_t *ra, uint32_t wait) {
+  // hands the kernel every entry it hasn't taken yet and waits for wait completions;
+  // EAGAIN and EBUSY mean completions have to be reaped first, the caller's loop comes back here
+  while (true) {
+    uint32_t tail = *ra->sqTail;
+    uint32_t pending = tail - __atomic_load_n(ra->sqHead, __ATOMIC_ACQUIRE);
+    if (pending == 0 && wait == 0) {
+      return;
+    }
+    if (syscall(__NR_io_uring_enter, ra->ring, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0) {
+      return;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EBUSY) {
+      return;
+    }
+    // the ring can't take them at all, take the entries back and read them here
+    uint32_t head = __atomic_load_n(ra->sqHead, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ra->sqTail, head, __ATOMIC_RELEASE);
+    for (; head != tail; head++) {
+      struct _ReadRequest *request = &ra->requests[ra->sqes[ra->sqArray[head & *ra->sqMask]].user_data];
+      while (request->length > 0) {
+        ssize_t result = pread(ra->fd, request->destination, request->length, request->offset);
+        if (result <= 0) {
+          ra->failed = true;
+          break;
+        }
+        request->destination += result;
+        request->offset += result;
+        request->length -= result;
+      }
+      request->busy = false;
+      ra->inFlight--;
+    }
+    return;
+  }
+}
+
+static void uringReap(Readahead_t *ra, bool wait) {
+  if (wait) {
+    uringEnter(ra, 1);
+  }
+  uint32_t head = *ra->cqHead;
+  while (head != __atomic_load_n(ra->cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ra->cqes[head & *ra->cqMask];
+    uint32_t slot = cqe->user_data;
+    int32_t result = cqe->res;
+    head++;
+    __atomic_store_n(ra->cqHead, head, __ATOMIC_RELEASE);
+    struct _ReadRequest *request = &ra->requests[slot];
+    if (result > 0 && (uint32_t)result < request->length) {
+      // short read, queue the rest
+      request->offset += result;
+      request->destination += result;
+      request->length -= result;
+      uringSubmit(ra, slot);
+      continue;
+    }
+    if (result <= 0) {
+      ra->failed = true;
+    }
+    request->busy = false;
+    ra->inFlight--;
+  }
+}
+
+static int poolSetup(Readahead_t *ra) {
+  if (pthread_mutex_init(&ra->lock, NULL) != 0) {
+    return 1;
+  }
+  if (pthread_cond_init(&ra->changed, NULL) != 0) {
+    pthread_mutex_destroy(&ra->lock);
+    return 1;
+  }
+  for (int i = 0; i < READAHEAD_THREADS; i++) {
+    if (pthread_create(&ra->threads[i], NULL, poolWorker, ra) != 0) {
+      pthread_mutex_lock(&ra->lock);
+      ra->stopping = true;
+      pthread_cond_broadcast(&ra->changed);
+      pthread_mutex_unlock(&ra->lock);
+      for (int j = 0; j < i; j++) {
+        pthread_join(ra->threads[j], NULL);
+      }
+      pthread_mutex_destroy(&ra->lock);
+      pthread_cond_destroy(&ra->changed);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *poolWorker(void *argument) {
+  Readahead_t *ra = argument;
+  pthread_mutex_lock(&ra->lock);
+  while (true) {
+    while (ra->queueLength == 0 && !ra->stopping) {
+      pthread_cond_wait(&ra->changed, &ra->lock);
+    }
+    if (ra->queueLength == 0) {
+      break;
+    }
+    struct _ReadRequest *request = &ra->requests[ra->queue[ra->queueHead]];
+    ra->queueHead = (ra->queueHead + 1) % READAHEAD_DEPTH;
+    ra->queueLength--;
+    struct _ReadRequest work = *request;
+    pthread_mutex_unlock(&ra->lock);
+    bool failed = false;
+    while (work.length > 0) {
+      ssize_t result = pread(ra->fd, work.destination, work.length, work.offset);
+      if (result <= 0) {
+        failed = true;
+        break;
+      }
+      work.destination += result;
+      work.offset += result;
+      work.length -= result;
+    }
+    pthread_mutex_lock(&ra->lock);
+    ra->failed |= failed;
+    request->busy = false;
+    ra->inFlight--;
+    pthread_cond_broadcast(&ra->changed);
+  }
+  pthread_mutex_unlock(&ra->lock);
+  return NULL;
+}
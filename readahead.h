@@ -0,0 +1,78 @@
+#ifndef __READAHEAD_
+#define __READAHEAD_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// maximum number of reads in flight and the size a coalesced read is capped at
+#define READAHEAD_DEPTH 32
+#define READAHEAD_MAX_EXTENT (1024 * 1024)
+#define READAHEAD_THREADS 4
+// entries asked for when probing io_uring for the operations it supports
+#define READAHEAD_PROBE_OPS 64
+
+enum readahead_backend {readahead_uring, readahead_threads};
+
+struct _ReadRequest {
+  uint64_t offset;
+  uint8_t *destination;
+  uint32_t length;
+  bool busy;
+};
+
+struct _Readahead {
+  enum readahead_backend backend;
+  int fd;
+  uint32_t depth;
+  uint32_t inFlight;
+  bool failed;
+  struct _ReadRequest requests[READAHEAD_DEPTH];
+  // io_uring
+  int ring;
+  void *sqRing;
+  void *cqRing;
+  size_t sqRingSize;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  uint32_t *sqHead;
+  uint32_t *sqTail;
+  uint32_t *sqMask;
+  uint32_t *sqArray;
+  uint32_t *cqHead;
+  uint32_t *cqTail;
+  uint32_t *cqMask;
+  struct io_uring_cqe *cqes;
+  // thread pool fallback, requests are handed out in submission order
+  pthread_t threads[READAHEAD_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint32_t queue[READAHEAD_DEPTH];
+  uint32_t queueHead;
+  uint32_t queueLength;
+  bool stopping;
+};
+
+typedef struct _Readahead Readahead_t;
+
+// internal functions
+
+static int uringSetup(Readahead_t *ra);
+static bool uringSupportsRead(int ring);
+static void uringSubmit(Readahead_t *ra, uint32_t slot);
+static void uringEnter(Readahead_t *ra, uint32_t wait);
+static void uringReap(Readahead_t *ra, bool wait);
+static int poolSetup(Readahead_t *ra);
+static void *poolWorker(void *argument);
+static uint32_t freeSlot(Readahead_t *ra);
+
+// API
+
+Readahead_t *readaheadCreate(int fd);
+int readaheadSubmit(Readahead_t *ra, uint64_t offset, uint8_t *destination, uint32_t length);
+int readaheadWait(Readahead_t *ra);
+const char *readaheadBackendName(Readahead_t *ra);
+void readaheadDestroy(Readahead_t *ra);
+
+#endif // __READAHEAD_
@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+static volatile sig_atomic_t stop_requested;
+
+int serverRun(const char *socket_path, char **images, int count, struct load_options_t options) {
+  // serves lookups and reads for a set of images on a unix socket, one request per line:
+  //   images                                 -> OK <n>, then "<index> <format> <name>" lines
+  //   stat <image> <path>                    -> OK <f|d> <size> <attributes> <cluster> <ctime> <mtime> <atime>
+  //   list <image> <path>                    -> OK <n>, then "<f|d> <size> <mtime> <name>" lines
+  //   read <image> <path> [offset [length]]  -> OK <n>, then n bytes of the file
+  //   find <image> [path] [filters]          -> OK <n>, then "<f|d> <size> <mtime> <path>" lines
+  // failures are answered with ERR <reason>, images are named by index, path or file name
+  Server_t server;
+  memset(&server, 0, sizeof(server));
+  server.socketPath = socket_path;
+  server.listener = -1;
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Socket path %s is too long\n", socket_path);
+    return 1;
+  }
+  strcpy(address.sun_path, socket_path);
+  server.volumes = calloc(count, sizeof(Volume_t *));
+  server.names = images;
+  if (server.volumes == NULL) {
+    printf("Couldn't allocate memory\n");
+    return 1;
+  }
+  // images aren't loaded into memory, file contents are sent straight from the page cache,
+  // so there's nothing for a readahead engine to do past reading the directories once
+  options.lazy = true;
+  options.noReadahead = true;
+  options.overlay = NULL; // overlays are for interactive sessions, several images can't share one
+  int status = 1;
+  for (int i = 0; i < count; i++) {
+    server.volumes[i] = volumeOpen(images[i], options);
+    if (server.volumes[i] == NULL) {
+      goto cleanup;
+    }
+    server.volumeCount++;
+  }
+  server.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (server.listener < 0) {
+    printf("Couldn't create a socket\n");
+    goto cleanup;
+  }
+  unlink(socket_path);
+  if (bind(server.listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server.listener, SERVER_QUEUE) != 0) {
+    printf("Couldn't listen on %s: %s\n", socket_path, strerror(errno));
+    goto cleanup;
+  }
+  if (pipe2(server.wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+    printf("Couldn't create a pipe: %s\n", strerror(errno));
+    goto cleanup;
+  }
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.changed, NULL);
+  for (int i = 0; i < SERVER_THREADS; i++) {
+    server.clients[i] = -1;
+  }
+  // the workers inherit a mask without SIGINT and SIGTERM, so they always interrupt poll()
+  sigset_t signals, previous;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  int started = 0;
+  for (; started < SERVER_THREADS; started++) {
+    if (pthread_create(&server.threads[started], NULL, serverWorker, &server) != 0) {
+      break;
+    }
+  }
+  // no SA_RESTART, a signal has to interrupt poll()
+  struct sigaction action = {.sa_handler = stopServer};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  printf("Serving %d %s on %s\n", count, count == 1 ? "image" : "images", socket_path);
+  fflush(stdout);
+  status = started > 0 ? 0 : 1;
+  // the listener and the wake pipe come first, then every connection waiting for its next request
+  struct pollfd *watched = NULL;
+  uint32_t watched_capacity = 0;
+  while (started > 0 && !stop_requested) {
+    if (watched_capacity < server.idleCount + 2) {
+      uint32_t capacity = MAX(watched_capacity * 2, server.idleCount + 2);
+      struct pollfd *grown = realloc(watched, capacity * sizeof(struct pollfd));
+      if (grown == NULL) {
+        printf("Couldn't allocate memory\n");
+        status = 1;
+        break;
+      }
+      watched = grown;
+      watched_capacity = capacity;
+    }
+    watched[0] = (struct pollfd){.fd = server.listener, .events = POLLIN};
+    watched[1] = (struct pollfd){.fd = server.wake[0], .events = POLLIN};
+    for (uint32_t i = 0; i < server.idleCount; i++) {
+      watched[i + 2] = (struct pollfd){.fd = server.idle[i]->fd, .events = POLLIN};
+    }
+    uint32_t watched_count = server.idleCount + 2;
+    if (poll(watched, watched_count, -1) < 0) {
+      if (errno != EINTR) {
+        printf("poll: %s\n", strerror(errno));
+        status = 1;
+        break;
+      }
+      continue;
+    }
+    // connections with input (or hung up ones, their read fails) go to the workers
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < server.idleCount; i++) {
+      Connection_t *connection = server.idle[i];
+      if (!(watched[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) {
+        server.idle[kept++] = connection;
+        continue;
+      }
+      pthread_mutex_lock(&server.lock);
+      while (server.queueLength == SERVER_QUEUE) {
+        pthread_cond_wait(&server.changed, &server.lock);
+      }
+      server.queue[(server.queueHead + server.queueLength) % SERVER_QUEUE] = connection;
+      server.queueLength++;
+      pthread_cond_broadcast(&server.changed);
+      pthread_mutex_unlock(&server.lock);
+    }
+    server.idleCount = kept;
+    if (watched[1].revents & POLLIN) {
+      char drained[64];
+      while (read(server.wake[0], drained, sizeof(drained)) > 0) {
+      }
+      pthread_mutex_lock(&server.lock);
+      Connection_t *returned = server.returned;
+      server.returned = NULL;
+      pthread_mutex_unlock(&server.lock);
+      while (returned != NULL) {
+        Connection_t *next = returned->next;
+        if (!addIdle(&server, returned)) {
+          closeConnection(returned);
+        }
+        returned = next;
+      }
+    }
+    if (watched[0].revents & POLLIN) {
+      int client = accept4(server.listener, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0 && errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+        printf("accept: %s\n", strerror(errno));
+        status = 1;
+        break;
+      }
+      Connection_t *connection = client >= 0 ? openConnection(client) : NULL;
+      if (client >= 0 && (connection == NULL || !addIdle(&server, connection))) {
+        // out of memory, the client is turned away instead of taking the server down
+        if (connection != NULL) {
+          closeConnection(connection);
+        } else {
+          close(client);
+        }
+      }
+    }
+  }
+  free(watched);
+  // wake up the threads stuck sending to slow clients and wait for them
+  pthread_mutex_lock(&server.lock);
+  server.stopping = true;
+  for (int i = 0; i < SERVER_THREADS; i++) {
+    if (server.clients[i] >= 0) {
+      shutdown(server.clients[i], SHUT_RDWR);
+    }
+  }
+  pthread_cond_broadcast(&server.changed);
+  pthread_mutex_unlock(&server.lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(server.threads[i], NULL);
+  }
+  for (; server.queueLength > 0; server.queueLength--) {
+    closeConnection(server.queue[server.queueHead]);
+    server.queueHead = (server.queueHead + 1) % SERVER_QUEUE;
+  }
+  while (server.returned != NULL) {
+    Connection_t *next = server.returned->next;
+    closeConnection(server.returned);
+    server.returned = next;
+  }
+  for (uint32_t i = 0; i < server.idleCount; i++) {
+    closeConnection(server.idle[i]);
+  }
+  free(server.idle);
+  pthread_mutex_destroy(&server.lock);
+  pthread_cond_destroy(&server.changed);
+  close(server.wake[0]);
+  close(server.wake[1]);
+  unlink(socket_path);
+cleanup:
+  if (server.listener >= 0) {
+    close(server.listener);
+  }
+  for (int i = 0; i < server.volumeCount; i++) {
+    volumeClose(server.volumes[i]);
+  }
+  free(server.volumes);
+  return status;
+}
+
+static void stopServer(int signal) {
+  stop_requested = 1;
+}
+
+static void *serverWorker(void *argument) {
+  Server_t *server = argument;
+  pthread_mutex_lock(&server->lock);
+  while (true) {
+    while (server->queueLength == 0 && !server->stopping) {
+      pthread_cond_wait(&server->changed, &server->lock);
+    }
+    if (server->stopping) {
+      break;
+    }
+    Connection_t *connection = server->queue[server->queueHead];
+    server->queueHead = (server->queueHead + 1) % SERVER_QUEUE;
+    server->queueLength--;
+    // remember the connection so that stopping the server can interrupt it
+    int slot = 0;
+    while (server->clients[slot] >= 0) {
+      slot++;
+    }
+    server->clients[slot] = connection->fd;
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+    bool open = serveConnection(server, connection);
+    pthread_mutex_lock(&server->lock);
+    server->clients[slot] = -1;
+    if (open) {
+      // back to the poll loop until the client sends more
+      connection->next = server->returned;
+      server->returned = connection;
+      char wake = 0;
+      ssize_t written = write(server->wake[1], &wake, 1);
+      (void)written; // a full pipe already wakes the loop up
+    } else {
+      closeConnection(connection);
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+static Connection_t *openConnection(int fd) {
+  Connection_t *connection = malloc(sizeof(Connection_t));
+  if (connection == NULL) {
+    return NULL;
+  }
+  connection->fd = fd;
+  connection->lineLength = 0;
+  connection->lineComplete = false;
+  connection->inputStart = 0;
+  connection->inputLength = 0;
+  connection->outputLength = 0;
+  connection->failed = false;
+  connection->next = NULL;
+  return connection;
+}
+
+static void closeConnection(Connection_t *connection) {
+  close(connection->fd);
+  free(connection);
+}
+
+static bool addIdle(Server_t *server, Connection_t *connection) {
+  if (server->idleCount == server->idleCapacity) {
+    uint32_t capacity = server->idleCapacity ? server->idleCapacity * 2 : 64;
+    Connection_t **grown = realloc(server->idle, capacity * sizeof(Connection_t *));
+    if (grown == NULL) {
+      return false;
+    }
+    server->idle = grown;
+    server->idleCapacity = capacity;
+  }
+  server->idle[server->idleCount++] = connection;
+  return true;
+}
+
+static bool serveConnection(Server_t *server, Connection_t *connection) {
+  // answers every complete request that has arrived, false once the connection should be closed
+  if (!fillInput(connection)) {
+    return false;
+  }
+  enum line_status status;
+  while (!connection->failed && (status = readLine(connection)) == line_ready) {
+    char *arguments[SERVER_MAX_ARGUMENTS];
+    int count = 0;
+    char *saveptr = NULL;
+    for (char *word = strtok_r(connection->line, " \t\r", &saveptr); word != NULL && count < SERVER_MAX_ARGUMENTS; word = strtok_r(NULL, " \t\r", &saveptr)) {
+      arguments[count++] = word;
+    }
+    if (count == 0) {
+      continue;
+    }
+    if (strcmp(arguments[0], "quit") == 0) {
+      return false;
+    }
+    handleRequest(server, connection, arguments, count);
+    flushOutput(connection);
+  }
+  return !connection->failed && status == line_partial;
+}
+
+static bool fillInput(Connection_t *connection) {
+  // one read, called when poll() saw input, so it doesn't block; false once the client is gone
+  if (connection->inputLength > 0) {
+    return true;
+  }
+  while (true) {
+    ssize_t result = read(connection->fd, connection->input, SERVER_LINE_SIZE);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    connection->inputStart = 0;
+    connection->inputLength = result;
+    return true;
+  }
+}
+
+static enum line_status readLine(Connection_t *connection) {
+  // takes the next line out of what was read so far, a partial one is kept for the next read
+  if (connection->lineComplete) {
+    connection->lineLength = 0;
+    connection->lineComplete = false;
+  }
+  while (connection->inputLength > 0) {
+    char c = connection->input[connection->inputStart++];
+    connection->inputLength--;
+    if (c == '\n') {
+      connection->line[connection->lineLength] = 0;
+      connection->lineComplete = true;
+      return line_ready;
+    }
+    if (connection->lineLength == SERVER_LINE_SIZE - 1) {
+      return line_too_long;
+    }
+    connection->line[connection->lineLength++] = c;
+  }
+  return line_partial;
+}
+
+static bool sendAll(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  while (size > 0) {
+    ssize_t result = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    bytes += result;
+    size -= result;
+  }
+  return true;
+}
+
+static void flushOutput(Connection_t *connection) {
+  if (connection->outputLength > 0 && !connection->failed) {
+    connection->failed = !sendAll(connection->fd, connection->output, connection->outputLength);
+  }
+  connection->outputLength = 0;
+}
+
+static void reply(Connection_t *connection, const char *format, ...) {
+  // responses are gathered in the output buffer and sent once it fills up or the request is done
+  for (int attempt = 0; attempt < 2; attempt++) {
+    uint32_t space = SERVER_BUFFER_SIZE - connection->outputLength;
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(connection->output + connection->outputLength, space, format, arguments);
+    va_end(arguments);
+    if (length >= 0 && (uint32_t)length < space) {
+      connection->outputLength += length;
+      return;
+    }
+    flushOutput(connection);
+  }
+}
+
+static Volume_t *findVolume(Server_t *server, const char *name) {
+  char *end;
+  long index = strtol(name, &end, 10);
+  if (*end == 0 && index >= 0 && index < server->volumeCount) {
+    return server->volumes[index];
+  }
+  for (int i = 0; i < server->volumeCount; i++) {
+    const char *base = strrchr(server->names[i], '/');
+    base = base ? base + 1 : server->names[i];
+    if (strcmp(server->names[i], name) == 0 || strcmp(base, name) == 0) {
+      return server->volumes[i];
+    }
+  }
+  return NULL;
+}
+
+static void handleRequest(Server_t *server, Connection_t *connection, char **arguments, int count) {
+  const char *command = arguments[0];
+  if (strcmp(command, "images") == 0) {
+    reply(connection, "OK %d\n", server->volumeCount);
+    for (int i = 0; i < server->volumeCount; i++) {
+      reply(connection, "%d %s %s\n", i, imageFormatName(server->volumes[i]->image), server->names[i]);
+    }
+    return;
+  }
+  if (strcmp(command, "stat") != 0 && strcmp(command, "list") != 0 && strcmp(command, "read") != 0 && strcmp(command, "find") != 0) {
+    reply(connection, "ERR unknown command\n");
+    return;
+  }
+  if (count < 2) {
+    reply(connection, "ERR missing image\n");
+    return;
+  }
+  Volume_t *volume = findVolume(server, arguments[1]);
+  if (volume == NULL) {
+    reply(connection, "ERR no such image\n");
+    return;
+  }
+  if (strcmp(command, "find") == 0) {
+    serveFind(connection, volume, arguments + 2, count - 2);
+    return;
+  }
+  if (count < 3) {
+    reply(connection, "ERR missing path\n");
+    return;
+  }
+  if (strcmp(command, "stat") == 0) {
+    serveStat(connection, volume, arguments[2]);
+  } else if (strcmp(command, "list") == 0) {
+    serveList(connection, volume, arguments[2]);
+  } else {
+    serveRead(connection, volume, arguments[2], count > 3 ? arguments[3] : NULL, count > 4 ? arguments[4] : NULL);
+  }
+}
+
+static void serveStat(Connection_t *connection, Volume_t *volume, const char *path) {
+  struct entry_table_t *table = &volume->table;
+  int32_t row = volumeLookup(volume, path);
+  if (row == -2) {
+    reply(connection, "ERR not found\n");
+    return;
+  }
+  if (row == -1) {
+    reply(connection, "OK d 0 %.2x 0 0 0 0\n", DIRECTORY);
+    return;
+  }
+  // a zero timestamp means the date isn't set and stays 0
+  uint32_t created = table->created[row] ? table->created[row] + UNIX_1980 : 0;
+  uint32_t modified = table->modified[row] ? table->modified[row] + UNIX_1980 : 0;
+  uint32_t accessed = table->accessed[row] ? table->accessed[row] + UNIX_1980 : 0;
+  reply(connection, "OK %c %u %.2x %u %u %u %u\n", table->attributes[row] & DIRECTORY ? 'd' : 'f', table->size[row],
+        table->attributes[row], table->firstCluster[row], created, modified, accessed);
+}
+
+static void serveList(Connection_t *connection, Volume_t *volume, const char *path) {
+  struct entry_table_t *table = &volume->table;
+  int32_t row = volumeLookup(volume, path);
+  if (row == -2) {
+    reply(connection, "ERR not found\n");
+    return;
+  }
+  if (row >= 0 && !(table->attributes[row] & DIRECTORY)) {
+    reply(connection, "ERR not a directory\n");
+    return;
+  }
+  // the children of a row are the rows of its subtree that aren't inside a deeper one
+  uint32_t first = row < 0 ? 0 : row + 1;
+  uint32_t last = row < 0 ? table->count : table->subtreeEnd[row];
+  uint32_t children = 0;
+  for (uint32_t i = first; i < last; i = table->subtreeEnd[i]) {
+    children++;
+  }
+  reply(connection, "OK %u\n", children);
+  for (uint32_t i = first; i < last; i = table->subtreeEnd[i]) {
+    uint32_t modified = table->modified[i] ? table->modified[i] + UNIX_1980 : 0;
+    reply(connection, "%c %u %u %s\n", table->attributes[i] & DIRECTORY ? 'd' : 'f', table->size[i], modified,
+          table->names + table->nameOffset[i]);
+  }
+}
+
+static void serveRead(Connection_t *connection, Volume_t *volume, const char *path, const char *offset, const char *length) {
+  struct entry_table_t *table = &volume->table;
+  int32_t row = volumeLookup(volume, path);
+  if (row == -2) {
+    reply(connection, "ERR not found\n");
+    return;
+  }
+  if (row == -1 || table->attributes[row] & DIRECTORY) {
+    reply(connection, "ERR is a directory\n");
+    return;
+  }
+  uint32_t start = offset ? strtoul(offset, NULL, 10) : 0;
+  uint32_t wanted = length ? strtoul(length, NULL, 10) : UINT32_MAX;
+  uint32_t extent_count;
+  struct extent_t *extents = volumeExtents(volume, row, start, wanted, &extent_count);
+  if (extents == NULL) {
+    reply(connection, "ERR broken cluster chain\n");
+    return;
+  }
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < extent_count; i++) {
+    total += extents[i].length;
+  }
+  reply(connection, "OK %lu\n", total);
+  flushOutput(connection);
+  // raw images are sent by the kernel from the page cache, compressed ones go through the output buffer
+  Image_t *image = volume->image;
+  for (uint32_t i = 0; i < extent_count && !connection->failed; i++) {
+    uint64_t position = extents[i].offset;
+    uint32_t remaining = extents[i].length;
+    if (volume->dataSection != NULL) {
+      uint8_t *data = (uint8_t *)volume->dataSection + (position - volume->dataOffset);
+      connection->failed = !sendAll(connection->fd, data, remaining);
+      continue;
+    }
+    while (remaining > 0 && image->format == image_raw) {
+      off_t file_offset = position;
+      ssize_t sent = sendfile(connection->fd, image->fd, &file_offset, remaining);
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      }
+      if (sent <= 0) {
+        connection->failed = true;
+        break;
+      }
+      position += sent;
+      remaining -= sent;
+    }
+    while (remaining > 0 && !connection->failed) {
+      uint32_t chunk = MIN(remaining, SERVER_BUFFER_SIZE);
+      // the image's block cache can only be used by one reader at a time
+      pthread_mutex_lock(&volume->lock);
+      bool fetched = imageRead(image, connection->output, chunk, position) == chunk;
+      pthread_mutex_unlock(&volume->lock);
+      // the length is already sent, so the connection can't carry on after a short read
+      connection->failed = !fetched || !sendAll(connection->fd, connection->output, chunk);
+      position += chunk;
+      remaining -= chunk;
+    }
+  }
+  free(extents);
+}
+
+static void serveFind(Connection_t *connection, Volume_t *volume, char **arguments, int count) {
+  struct entry_table_t *table = &volume->table;
+  uint32_t matches;
+  char error[QUERY_ERROR_SIZE];
+  uint32_t *rows = volumeFind(volume, arguments, count, &matches, error, sizeof(error));
+  if (rows == NULL) {
+    reply(connection, "ERR %s\n", error);
+    return;
+  }
+  char path[PATH_SIZE];
+  reply(connection, "OK %u\n", matches);
+  for (uint32_t i = 0; i < matches; i++) {
+    uint32_t row = rows[i];
+    uint32_t modified = table->modified[row] ? table->modified[row] + UNIX_1980 : 0;
+    volumePath(volume, row, path, sizeof(path));
+    reply(connection, "%c %u %u %s\n", table->attributes[row] & DIRECTORY ? 'd' : 'f', table->size[row], modified, path);
+  }
+  free(rows);
+}
@@ -0,0 +1,80 @@
+#ifndef __SERVER_
+#define __SERVER_
+
+#include "FAT.h"
+
+// a poll loop watches every idle connection, requests are handed to a fixed pool of threads once
+// something arrives, so idle clients don't hold a thread; connections with input wait in a queue
+#define SERVER_THREADS 8
+#define SERVER_QUEUE 64
+#define SERVER_LINE_SIZE 4096
+#define SERVER_BUFFER_SIZE (64 * 1024)
+#define SERVER_MAX_ARGUMENTS 32
+
+struct _Connection;
+
+enum line_status {line_ready, line_partial, line_too_long};
+
+struct _Server {
+  const char *socketPath;
+  int listener;
+  Volume_t **volumes;
+  char **names;
+  int volumeCount;
+  pthread_t threads[SERVER_THREADS];
+  int clients[SERVER_THREADS]; // connection each thread is serving, -1 when idle
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct _Connection *queue[SERVER_QUEUE]; // connections with input, waiting for a thread
+  uint32_t queueHead;
+  uint32_t queueLength;
+  struct _Connection *returned; // served connections going back to the poll loop
+  int wake[2]; // written to whenever a connection is returned, so poll() picks it up
+  struct _Connection **idle; // only touched by the poll loop
+  uint32_t idleCount;
+  uint32_t idleCapacity;
+  bool stopping;
+};
+
+struct _Connection {
+  int fd;
+  char line[SERVER_LINE_SIZE];
+  uint32_t lineLength;
+  bool lineComplete;
+  char input[SERVER_LINE_SIZE];
+  uint32_t inputStart;
+  uint32_t inputLength;
+  char output[SERVER_BUFFER_SIZE];
+  uint32_t outputLength;
+  bool failed;
+  struct _Connection *next; // in the returned list
+};
+
+typedef struct _Server Server_t;
+typedef struct _Connection Connection_t;
+
+// internal functions
+
+static void *serverWorker(void *argument);
+static Connection_t *openConnection(int fd);
+static void closeConnection(Connection_t *connection);
+static bool addIdle(Server_t *server, Connection_t *connection);
+static bool serveConnection(Server_t *server, Connection_t *connection);
+static bool fillInput(Connection_t *connection);
+static enum line_status readLine(Connection_t *connection);
+static bool sendAll(int fd, const void *data, size_t size);
+static void flushOutput(Connection_t *connection);
+static void reply(Connection_t *connection, const char *format, ...);
+static Volume_t *findVolume(Server_t *server, const char *name);
+static void handleRequest(Server_t *server, Connection_t *connection, char **arguments, int count);
+static void serveStat(Connection_t *connection, Volume_t *volume, const char *path);
+static void serveList(Connection_t *connection, Volume_t *volume, const char *path);
+static void serveRead(Connection_t *connection, Volume_t *volume, const char *path, const char *offset, const char *length);
+static void serveFind(Connection_t *connection, Volume_t *volume, char **arguments, int count);
+static void stopServer(int signal);
+
+// API
+
+int serverRun(const char *socket_path, char **images, int count, struct load_options_t options);
+
+#endif // __SERVER_